@@ -8,74 +8,234 @@
    int find_newline(const char *buf, int len);
 
 */
+#define _GNU_SOURCE // pidfd_send_signal
 #include "jobprotocol.h"
 #include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
 #include <string.h>
 #include <stdlib.h>
+#include <fcntl.h>
 #include <sys/signal.h>
+#include <sys/pidfd.h>
+#include <arpa/inet.h>
 #include <unistd.h>
 
+Pool job_pool = POOL_INITIALIZER("job", JobNode, 16);
+Pool watcher_pool = POOL_INITIALIZER("watcher", WatcherNode, 64);
+
+// Slabs of about 64 KiB, or a single buffer for the larger sizes
+#define BUFFER_POOL(shift) POOL_INITIALIZER("buffer " #shift, char[BUFSIZE << (shift)], \
+        (BUFSIZE << (shift)) < (64 << 10) ? (64 << 10) / (BUFSIZE << (shift)) : 1)
+Pool buffer_pools[BUF_CLASSES] = {
+    BUFFER_POOL(0), BUFFER_POOL(1), BUFFER_POOL(2), BUFFER_POOL(3), BUFFER_POOL(4),
+    BUFFER_POOL(5), BUFFER_POOL(6), BUFFER_POOL(7), BUFFER_POOL(8),
+};
+
+// Text protocol name of each JobCommand
+#define JOB_COMMAND_NAME(command, name, min_args, max_args) [command] = name,
+const char *job_command_names[N_JOB_COMMANDS] = {JOB_COMMANDS(JOB_COMMAND_NAME)};
+
+/* Returns the JobCommand named by the len bytes at name, or CMD_INVALID if
+ * there is none. The comparisons are generated from JOB_COMMANDS, so each
+ * is a length check and a fixed size memcmp the compiler inlines.
+ */
+JobCommand find_job_command(const char *name, int len){
+#define JOB_COMMAND_MATCH(command, text, min_args, max_args) \
+    if(len == sizeof(text) - 1 && memcmp(name, text, sizeof(text) - 1) == 0){ \
+        return command; \
+    }
+    JOB_COMMANDS(JOB_COMMAND_MATCH)
+#undef JOB_COMMAND_MATCH
+    return CMD_INVALID;
+}
+
 /* Returns the specific JobCommand enum value related to the
- * input str. Returns CMD_INVALID if no match is found.
+ * input str, which is matched up to its first space. Returns CMD_INVALID
+ * if no match is found.
  */
-//JobCommand get_job_command(char*){
-//
-//}
+JobCommand get_job_command(char *str){
+    return find_job_command(str, strcspn(str, " "));
+}
 
-/* Forks the process and launches a job executable. Allocates a
- * JobNode containing PID, stdout and stderr pipes, and returns
- * it. Returns NULL if the JobNode could not be created.
+/* Allocates a JobNode for a job the zygote has started, taking over its
+ * pidfd and the read ends of its stdout and stderr pipes, which are made
+ * non-blocking. jobname is the program's path or name.
+ * Returns NULL if the JobNode could not be allocated.
  */
+JobNode* new_job(const char *jobname, int pid, int pidfd, int stdout_fd, int stderr_fd){
+	JobNode *job = pool_alloc(&job_pool);
+	if(job == NULL){
+	    return NULL;
+	}
+	job->pid = pid;
+	// Signals sent through the pidfd cannot reach a recycled pid
+	job->pidfd = pidfd;
+	job->stdout_fd = stdout_fd;
+	job->stderr_fd = stderr_fd;
+	set_nonblocking(job->stdout_fd);
+	set_nonblocking(job->stderr_fd);
+	job->dead = 0;
+	job->wait_status = 0;
+	const char *name = strrchr(jobname, '/');
+	snprintf(job->name, JOB_NAME_MAX, "%s", name != NULL ? name + 1 : jobname);
+	clock_gettime(CLOCK_MONOTONIC, &(job->started));
+	memset(&(job->usage), 0, sizeof(job->usage));
+	init_buffer(&(job->stdout_buffer));
+	init_buffer(&(job->stderr_buffer));
+	job->watcher_list.first = NULL;
+	job->watcher_list.count = 0;
+	job->raw_watchers = NULL;
+	job->history.head = 0;
+	job->history.count = 0;
+	job->prev = NULL;
+	job->next = NULL;
+	return job;
+}
 
-JobNode* start_job(char * jobname, char * const args[]){
+/* Returns the slot in the job table where job_pid hashes to.
+ */
+static int job_slot(JobList *joblist, int job_pid){
+    // Fibonacci hashing spreads consecutive pids across the table
+    return ((uint32_t)job_pid * 2654435769u) >> (32 - joblist->bits);
+}
 
-//	printf("%s\n", jobname);
-//	printf("%s\n", args[0]);
-        int result;
-	JobNode *job = malloc(sizeof(struct job_node));
-	job->pid = 0;
-        int pipe1_fds[2];
-	int pipe2_fds[2];
-        if(pipe(pipe1_fds) == -1){
-            perror("pipe");
-        }
-	if(pipe(pipe2_fds) == -1){
-	    perror("pipe");
-	}
-        result = fork();
-        if(result > 0){ // parent
-            if(close(pipe1_fds[PIPE_READ]) == -1){
-                perror("close PIPE_READ");
-            }
-            if(close(pipe1_fds[PIPE_WRITE]) == -1){
-                perror("close PIPE_WRITE");
-            }
-	    if(close(pipe2_fds[PIPE_READ]) == -1){
-		perror("close PIPE2_READ");
-	    }
-	    if(close(pipe2_fds[PIPE_WRITE]) == -1){
-		perror("close PIPE2_WRITE");
-	    }
-	    job->stdout_fd = pipe1_fds[PIPE_READ];
-            job->stderr_fd = pipe2_fds[PIPE_READ];
-            job->pid = result;
-            job->dead = 0;
-            job->next = NULL;
+/* Places job in the first free slot at or after its hash slot.
+ */
+static void job_table_insert(JobList *joblist, JobNode *job){
+    int mask = (1 << joblist->bits) - 1;
+    int slot = job_slot(joblist, job->pid);
+    while(joblist->slots[slot] != NULL){
+        slot = (slot + 1) & mask;
+    }
+    joblist->slots[slot] = job;
+}
 
+/* Doubles the job table and rehashes every job into it.
+ * Returns 0 on success, -1 on error.
+ */
+static int job_table_grow(JobList *joblist){
+    int bits = joblist->slots == NULL ? JOB_TABLE_MIN_BITS : joblist->bits + 1;
+    JobNode **slots = calloc((size_t)1 << bits, sizeof(JobNode *));
+    if(slots == NULL){
+        perror("calloc job table");
+        return -1;
+    }
+    free(joblist->slots);
+    joblist->slots = slots;
+    joblist->bits = bits;
+    for(JobNode *current = joblist->first; current != NULL; current = current->next){
+        job_table_insert(joblist, current);
+    }
+    return 0;
+}
+
+/* Returns the job table slot holding job_pid, or -1 if not found.
+ */
+static int job_table_lookup(JobList *joblist, int job_pid){
+    if(joblist->slots == NULL){
+        return -1;
+    }
+    int mask = (1 << joblist->bits) - 1;
+    int slot = job_slot(joblist, job_pid);
+    while(joblist->slots[slot] != NULL){
+        if(joblist->slots[slot]->pid == job_pid){
+            return slot;
         }
-        else if(result == 0){ // child
-	    if(close(pipe1_fds[PIPE_READ]) == -1){
-                perror("close PIPE_READ CHILD");
-            }
-	    if(close(pipe2_fds[PIPE_READ]) == -1){
-                perror("close PIPE2_READ CHILD");
-            }
-            dup2(pipe1_fds[PIPE_READ], STDOUT_FILENO);
-	    dup2(pipe2_fds[PIPE_READ], STDERR_FILENO);
-	    execv(jobname, args);
-            perror("exec");
+        slot = (slot + 1) & mask;
+    }
+    return -1;
+}
+
+/* Empties a slot of the job table, shifting back any job after it whose
+ * probe sequence passes through the slot, so lookups need no tombstones.
+ */
+static void job_table_delete(JobList *joblist, int slot){
+    int mask = (1 << joblist->bits) - 1;
+    int hole = slot;
+    int next = (slot + 1) & mask;
+    while(joblist->slots[next] != NULL){
+        int home = job_slot(joblist, joblist->slots[next]->pid);
+        // The job can fill the hole if the hole lies between its home slot
+        // and where it is now, going around the end of the table.
+        if(((next - home) & mask) >= ((next - hole) & mask)){
+            joblist->slots[hole] = joblist->slots[next];
+            hole = next;
         }
-	return job;
+        next = (next + 1) & mask;
+    }
+    joblist->slots[hole] = NULL;
+}
+
+/* Initializes an empty job list.
+ */
+void init_job_list(JobList *joblist){
+    joblist->first = NULL;
+    joblist->last = NULL;
+    joblist->count = 0;
+    joblist->slots = NULL;
+    joblist->bits = 0;
+}
+
+/* Returns the job with the given pid in the list, or NULL if not found.
+ */
+JobNode *find_job(JobList *joblist, int job_pid){
+    int slot = job_table_lookup(joblist, job_pid);
+    return slot == -1 ? NULL : joblist->slots[slot];
+}
+
+/* Initializes an empty job table.
+ */
+void init_job_table(JobTable *table){
+    for(int i = 0; i < JOB_SHARDS; i++){
+        init_job_list(&(table->shards[i]));
+        pthread_mutex_init(&(table->locks[i]), NULL);
+    }
+    table->count = 0;
+}
+
+/* Locks the shard of the job table that holds, or would hold, the given
+ * pid, and returns it.
+ */
+JobList *lock_job_shard(JobTable *table, int job_pid){
+    // pids are handed out in sequence, so consecutive jobs use different shards
+    int shard = (unsigned int)job_pid % JOB_SHARDS;
+    pthread_mutex_lock(&(table->locks[shard]));
+    return &(table->shards[shard]);
+}
+
+/* Unlocks the shard of the job table locked by lock_job_shard.
+ */
+void unlock_job_shard(JobTable *table, int job_pid){
+    pthread_mutex_unlock(&(table->locks[(unsigned int)job_pid % JOB_SHARDS]));
+}
+
+/* Reserves room for one more job in the table.
+ * Returns 0 on success, or -1 if MAX_JOBS jobs are already reserved.
+ */
+int reserve_job_slot(JobTable *table){
+    if(__atomic_add_fetch(&(table->count), 1, __ATOMIC_RELAXED) > MAX_JOBS){
+        __atomic_sub_fetch(&(table->count), 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    return 0;
+}
+
+/* Gives back room reserved with reserve_job_slot.
+ */
+void release_job_slot(JobTable *table){
+    __atomic_sub_fetch(&(table->count), 1, __ATOMIC_RELAXED);
+}
+
+/* Frees every job in every shard of the table.
+ */
+void empty_job_table(JobTable *table){
+    for(int i = 0; i < JOB_SHARDS; i++){
+        pthread_mutex_lock(&(table->locks[i]));
+        empty_job_list(&(table->shards[i]));
+        pthread_mutex_unlock(&(table->locks[i]));
+    }
+    table->count = 0;
 }
 
 /* Adds the given job to the given list of jobs.
@@ -86,17 +246,25 @@ int add_job(JobList* joblist, JobNode* job){
     if(joblist->count == MAX_JOBS){ // already max jobs cant add any more
 	return -1;
     }
-    struct job_node *current;
-    current = joblist->first;
-    if(joblist->count == 0){
-	joblist->first = job;
-	joblist->count++;
-	return 0;
+    if(find_job(joblist, job->pid) != NULL){
+        return -1;
+    }
+    // Keep the table at most half full so probe sequences stay short
+    if(joblist->slots == NULL || 2 * (joblist->count + 1) > (1 << joblist->bits)){
+        if(job_table_grow(joblist) == -1){
+            return -1;
+        }
+    }
+    job_table_insert(joblist, job);
+    job->next = NULL;
+    job->prev = joblist->last;
+    if(joblist->last != NULL){
+        joblist->last->next = job;
     }
-    while(current->next != NULL){
-	current = current->next;
+    else{
+        joblist->first = job;
     }
-    current->next = job;
+    joblist->last = job;
     joblist->count++;
     return 0;
 }
@@ -106,115 +274,149 @@ int add_job(JobList* joblist, JobNode* job){
  * the kill command failed.
  */
 int kill_job(JobList* joblist, int job_pid){
-    struct job_node *current;
-    current = joblist->first;
-    while(current != NULL){
-	if(current->pid == job_pid){
-	    if(kill(current->pid, SIGKILL) == -1){
-		return -1;
-	    }
-   	    return 0;
-	}
-	current = current->next;
+    JobNode *job = find_job(joblist, job_pid);
+    if(job == NULL){
+        return 1;
     }
-    return 1;
+    return kill_job_node(job);
 }
 
 /* Removes a job from the given job list and frees it from memory.
  * Returns 0 if successful, or -1 if not found.
  */
 int remove_job(JobList* joblist, int job_pid){
-    struct job_node *current;
-    struct job_node *prev;
-    prev = joblist->first;
-    current = prev->next;
-    if(prev->pid == job_pid){
-	free(joblist->first);
-	joblist->first = current;
-	joblist->count--;
-	return 0;
+    int slot = job_table_lookup(joblist, job_pid);
+    if(slot == -1){
+        return -1;
     }
-    while(current->next != NULL){
-        if(current->pid == job_pid){
-	    prev->next = current->next;
-	    free(current);
-	    joblist->count--;
-	    return 0;
-	}
-        current = current->next;
-	prev = prev->next;
+    JobNode *job = joblist->slots[slot];
+    job_table_delete(joblist, slot);
+    if(job->prev != NULL){
+        job->prev->next = job->next;
     }
-    return -1;
+    else{
+        joblist->first = job->next;
+    }
+    if(job->next != NULL){
+        job->next->prev = job->prev;
+    }
+    else{
+        joblist->last = job->prev;
+    }
+    joblist->count--;
+    delete_job_node(job);
+    return 0;
 }
 
-/* Marks a job as dead.
+/* Marks a job as dead with the wait status it exited with and the
+ * resources it used.
  * Returns 0 on success, or -1 if not found.
  */
-int mark_job_dead(JobList *joblist, int job_pid, int deadvalue){
-    struct job_node *current;
-    current = joblist->first;
-    while(current->next != NULL){
-        if(current->pid == job_pid){
-            current->dead = deadvalue;
-            return 0;
-        }
-	current = current->next;
+int mark_job_dead(JobList *joblist, int job_pid, int wait_status, struct rusage *usage){
+    JobNode *job = find_job(joblist, job_pid);
+    if(job == NULL){
+        return -1;
     }
-    return -1;
+    job->dead = 1;
+    job->wait_status = wait_status;
+    job->usage = *usage;
+    return 0;
 }
 
 /* Frees all memory held by a job list and resets it.
  * Returns 0 on success, -1 otherwise.
  */
 int empty_job_list(JobList* joblist){
-
-    if(joblist->count == 0){
-	return -1;
-    }
     struct job_node *current;
     struct job_node *temp;
     current = joblist->first;
     while(current != NULL){
 	temp = current;
         current = current->next;
-	free(temp);
-	joblist->count--;
+	delete_job_node(temp);
     }
-    joblist = NULL;
+    free(joblist->slots);
+    init_job_list(joblist);
     return 0;
 }
 
-/* Frees all memory held by a job node and its children.
+// Bytes of output kept in the histories of all jobs
+static long history_bytes;
+
+/* Drops the oldest line of a job's history.
+ */
+static void history_pop(JobNode *job){
+    struct history_entry *oldest = &(job->history.entries[job->history.head]);
+    __atomic_sub_fetch(&history_bytes, oldest->chunk->len, __ATOMIC_RELAXED);
+    chunk_unref(oldest->chunk);
+    job->history.head = (job->history.head + 1) % JOB_HISTORY_LINES;
+    job->history.count--;
+}
+
+/* Keeps a reference to a line of the job's output in its history, dropping
+ * its oldest lines when it has JOB_HISTORY_LINES, or when all histories
+ * together would hold more than JOB_HISTORY_BYTES. The line is not kept if
+ * it does not fit even then.
+ */
+void history_push(JobNode *job, Chunk *chunk, int is_stderr, int prefix_len){
+    if(job->history.count == JOB_HISTORY_LINES){
+        history_pop(job);
+    }
+    // Jobs only give up their own lines, so a busy job cannot empty the
+    // history of the others
+    while(__atomic_add_fetch(&history_bytes, chunk->len, __ATOMIC_RELAXED) > JOB_HISTORY_BYTES){
+        __atomic_sub_fetch(&history_bytes, chunk->len, __ATOMIC_RELAXED);
+        if(job->history.count == 0){
+            return;
+        }
+        history_pop(job);
+    }
+    struct history_entry *entry = &(job->history.entries[
+        (job->history.head + job->history.count) % JOB_HISTORY_LINES]);
+    chunk_ref(chunk);
+    entry->chunk = chunk;
+    entry->is_stderr = is_stderr;
+    entry->prefix_len = prefix_len;
+    job->history.count++;
+}
+
+/* Drops every line of the job's history.
+ */
+void history_clear(JobNode *job){
+    while(job->history.count > 0){
+        history_pop(job);
+    }
+}
+
+/* Frees all memory held by a job node and its watchers, and closes
+ * its pipes.
  */
 int delete_job_node(JobNode* job){
-    struct job_node *current;
-    struct job_node *temp;
-    current = job;
-    while(current != NULL){
-        temp = current;
-        current = current->next;
-        free(temp);
+    if(job->stdout_fd != -1){
+        close(job->stdout_fd);
+    }
+    if(job->stderr_fd != -1){
+        close(job->stderr_fd);
     }
-    job = NULL;
+    if(job->pidfd != -1){
+        close(job->pidfd);
+    }
+    empty_watcher_list(&(job->watcher_list));
+    history_clear(job);
+    free_buffer(&(job->stdout_buffer));
+    free_buffer(&(job->stderr_buffer));
+    pool_free(&job_pool, job);
     return 0;
 }
 
-/* Kills all jobs. Return number of jobs in list. (Kills all dead jobs?)
+/* Kills all jobs. Return number of jobs in list.
  */
 int kill_all_jobs(JobList *joblist){
-//    int count = joblist->count;
     struct job_node *current;
-    current = joblist->first;
-    while(current != NULL){
-        if(current->dead > 0){
-	    if(remove_job(joblist, current->pid) == -1){
-		perror("dead job not found kill_all_jobs");
-	    }
-//	    if(kill(current->pid, SIGKILL) == 0){
-//	    joblist->count--;
-//	    }
+    for(current = joblist->first; current != NULL; current = current->next){
+        if(!current->dead && kill_job_node(current) == -1){
+            perror("kill_all_jobs");
         }
-        current = current->next;
     }
     return joblist->count;
 }
@@ -227,13 +429,180 @@ int kill_job_node(JobNode *job){
     if(job == NULL){
 	return 1;
     }
-    if(kill(job->pid, SIGKILL) == -1){
+    if(job->pidfd != -1){
+        if(pidfd_send_signal(job->pidfd, SIGKILL, NULL, 0) == -1){
+            return -1;
+        }
+    }
+    else if(kill(job->pid, SIGKILL) == -1){
 	return -1;
     }
     return 0;
 
 }
 
+/* Adds the given client to the watchers of the given job. The job's shard
+ * must be locked, and the client must not be.
+ * Returns 0 on success, -1 otherwise.
+ */
+int add_watcher(JobNode *job, Client *client){
+    WatcherNode *watcher = pool_alloc(&watcher_pool);
+    if(watcher == NULL){
+        return -1;
+    }
+    WatcherList *watchers = &(job->watcher_list);
+    watcher->client = client;
+    watcher->job = job;
+    watcher->prev = NULL;
+    watcher->next = watchers->first;
+    if(watchers->first != NULL){
+        watchers->first->prev = watcher;
+    }
+    watchers->first = watcher;
+    watchers->count++;
+
+    pthread_mutex_lock(&(client->lock));
+    watcher->client_prev = NULL;
+    watcher->client_next = client->watching;
+    if(client->watching != NULL){
+        client->watching->client_prev = watcher;
+    }
+    client->watching = watcher;
+    pthread_mutex_unlock(&(client->lock));
+    return 0;
+}
+
+/* Unlinks a watcher from its client's watching list. The client must be
+ * locked.
+ */
+static void unlink_client_watcher(WatcherNode *watcher){
+    Client *client = watcher->client;
+    if(watcher->client_prev != NULL){
+        watcher->client_prev->client_next = watcher->client_next;
+    }
+    else{
+        client->watching = watcher->client_next;
+    }
+    if(watcher->client_next != NULL){
+        watcher->client_next->client_prev = watcher->client_prev;
+    }
+}
+
+/* Unlinks a watcher from its job and its client and frees it from memory.
+ * The job's shard must be locked, and the client must not be.
+ */
+void remove_watcher(WatcherNode *watcher){
+    WatcherList *watchers = &(watcher->job->watcher_list);
+    if(watcher->prev != NULL){
+        watcher->prev->next = watcher->next;
+    }
+    else{
+        watchers->first = watcher->next;
+    }
+    if(watcher->next != NULL){
+        watcher->next->prev = watcher->prev;
+    }
+    watchers->count--;
+
+    pthread_mutex_lock(&(watcher->client->lock));
+    unlink_client_watcher(watcher);
+    pthread_mutex_unlock(&(watcher->client->lock));
+    pool_free(&watcher_pool, watcher);
+}
+
+/* Returns the client's watcher of the job with the given pid, or NULL if
+ * it is not watching it. The client's watching list is walked under its
+ * lock, which must not be held already. Watchers are only freed with
+ * their job's shard locked, so a caller holding that lock may keep using
+ * the watcher after the client lock is released.
+ */
+WatcherNode *find_watcher(Client *client, int job_pid){
+    pthread_mutex_lock(&(client->lock));
+    WatcherNode *watcher = client->watching;
+    while(watcher != NULL && watcher->job->pid != job_pid){
+        watcher = watcher->client_next;
+    }
+    pthread_mutex_unlock(&(client->lock));
+    return watcher;
+}
+
+/* Removes a client from the watcher list of every job it watches. Only
+ * the client's own subscriptions are visited.
+ */
+void remove_client_from_all_watchers(JobTable *table, Client *client){
+    while(1){
+        // The shard must be locked before the client, so the pid is looked
+        // up first; the job may end before its shard is locked
+        pthread_mutex_lock(&(client->lock));
+        int pid = client->watching != NULL ? client->watching->job->pid : -1;
+        pthread_mutex_unlock(&(client->lock));
+        if(pid == -1){
+            return;
+        }
+        lock_job_shard(table, pid);
+        // Watchers of jobs in a locked shard cannot go away under us
+        WatcherNode *watcher = find_watcher(client, pid);
+        if(watcher != NULL){
+            remove_watcher(watcher);
+        }
+        unlock_job_shard(table, pid);
+    }
+}
+
+/* Adds the given client as a watcher of a given job pid.
+ * Returns 0 on success, 1 if job was not found, or -1 if watcher could not
+ * be allocated.
+ */
+int add_watcher_by_pid(JobList *joblist, int job_pid, Client *client){
+    JobNode *job = find_job(joblist, job_pid);
+    if(job == NULL){
+        return 1;
+    }
+    return add_watcher(job, client);
+}
+
+/* Removes the given client from the watchers of a given job pid.
+ * Returns 0 on success, 1 if job was not found, or 2 if the client was
+ * not watching it.
+ */
+int remove_watcher_by_pid(JobList *joblist, int job_pid, Client *client){
+    JobNode *job = find_job(joblist, job_pid);
+    if(job == NULL){
+        return 1;
+    }
+    WatcherNode *watcher = find_watcher(client, job_pid);
+    if(watcher == NULL){
+        return 2;
+    }
+    remove_watcher(watcher);
+    return 0;
+}
+
+/* Frees all memory held by a watcher list and resets it.
+ * Returns 0 on success, -1 otherwise.
+ */
+int empty_watcher_list(WatcherList *watchers){
+    delete_watcher_node(watchers->first);
+    watchers->first = NULL;
+    watchers->count = 0;
+    return 0;
+}
+
+/* Frees all memory held by a watcher node and its children, unlinking
+ * each from its client.
+ */
+int delete_watcher_node(WatcherNode *watcher){
+    while(watcher != NULL){
+        WatcherNode *next = watcher->next;
+        pthread_mutex_lock(&(watcher->client->lock));
+        unlink_client_watcher(watcher);
+        pthread_mutex_unlock(&(watcher->client->lock));
+        pool_free(&watcher_pool, watcher);
+        watcher = next;
+    }
+    return 0;
+}
+
 /* Replaces the first '\n' or '\r\n' found in str with a null terminator.
  * Returns the index of the new first null terminator if found, or -1 if
  * not found.
@@ -302,46 +671,268 @@ int find_unix_newline(const char *buf, int inbuf){
     return -1;
 }
 
+/* Returns the pool that storage of the given size comes from.
+ */
+static Pool *buffer_pool(int size){
+    return &buffer_pools[__builtin_ctz(size / BUFSIZE)];
+}
+
+/* Moves the buffer's bytes to storage twice its size, or BUFSIZE bytes if
+ * it has none. Consumed bytes must already be shifted out.
+ * Returns 0 on success, or -1 with errno set to ENOBUFS if the buffer is
+ * BUF_MAX bytes already, or ENOMEM if no storage could be allocated.
+ */
+static int grow_buffer(Buffer *buffer){
+    int size = buffer->size == 0 ? BUFSIZE : buffer->size * 2;
+    if(size > BUF_MAX){
+        errno = ENOBUFS;
+        return -1;
+    }
+    char *buf = pool_alloc(buffer_pool(size));
+    if(buf == NULL){
+        errno = ENOMEM;
+        return -1;
+    }
+    if(buffer->buf != NULL){
+        memcpy(buf, buffer->buf, buffer->inbuf);
+        pool_free(buffer_pool(buffer->size), buffer->buf);
+    }
+    buffer->buf = buf;
+    buffer->size = size;
+    return 0;
+}
+
 /* Read as much as possible from file descriptor fd into the given buffer.
- * Returns number of bytes read, or 0 if fd closed, or -1 on error.
+ * New bytes are appended after any partial message already in the buffer;
+ * consumed bytes are only shifted out when the tail of the buffer is full,
+ * and the buffer only grows when a partial message fills all of it.
+ * Returns number of bytes read, or 0 if fd closed, or -1 on error. If the
+ * buffer holds BUF_MAX bytes without a complete message, returns -1 with
+ * errno set to ENOBUFS.
  */
 int read_to_buf(int fd, Buffer* buffer){
-    int num_read = read(fd, buffer->buf, BUFSIZE+2);
-    buffer->inbuf = num_read;
+    return read_to_buf_max(fd, buffer, BUF_MAX);
+}
+
+/* Same as read_to_buf, reading no more than max bytes.
+ */
+int read_to_buf_max(int fd, Buffer* buffer, int max){
+    if(buffer->inbuf == buffer->size){
+        shift_buffer(buffer);
+    }
+    if(buffer->inbuf == buffer->size && grow_buffer(buffer) == -1){
+        return -1;
+    }
+    int space = buffer->size - buffer->inbuf;
+    int num_read = read(fd, buffer->buf + buffer->inbuf, space < max ? space : max);
     if(num_read ==  -1){
 	return -1;
     }
     if(num_read == 0){
 	return 0;
     }
+    buffer->inbuf += num_read;
     return num_read;
 }
 
 /* Returns a pointer to the next message in the buffer, sets msg_len to
  * the length of characters in the message, with the given newline type.
  * Returns NULL if no message is left.
+ *
+ * The newline is replaced by a null terminator in place, so the message
+ * points into the buffer and stays valid until the next read_to_buf.
+ * With NEWLINE_LF a '\r' before the '\n' is also removed. Bytes already
+ * searched are not searched again when a partial message grows.
  */
-char* get_next_msg(Buffer* buffer, int* something, NewlineType something2){
-    char *ptr = "hi";
-
-    return ptr;
+char* get_next_msg(Buffer* buffer, int* msg_len, NewlineType newline){
+    if(buffer->consumed == buffer->inbuf){
+        return NULL;
+    }
+    if(buffer->discarding){
+        char *nl = memchr(buffer->buf + buffer->consumed, '\n', buffer->inbuf - buffer->consumed);
+        if(nl == NULL){
+            reset_buffer(buffer);
+            buffer->discarding = 1;
+            return NULL;
+        }
+        buffer->discarding = 0;
+        skip_buffer(buffer, nl + 1 - (buffer->buf + buffer->consumed));
+    }
+    int start = buffer->consumed;
+    if(buffer->scanned < start){
+        buffer->scanned = start;
+    }
+    char *end = buffer->buf + buffer->inbuf;
+    char *search = buffer->buf + buffer->scanned;
+    char *nl;
+    while((nl = memchr(search, '\n', end - search)) != NULL){
+        int index = nl - buffer->buf;
+        int has_cr = index > start && buffer->buf[index - 1] == '\r';
+        if(newline == NEWLINE_LF || has_cr){
+            int len = has_cr ? index - 1 - start : index - start;
+            buffer->buf[start + len] = '\0';
+            *msg_len = len;
+            buffer->consumed = index + 1;
+            buffer->scanned = index + 1;
+            if(buffer->consumed == buffer->inbuf){
+                // Everything is consumed: start over without moving anything
+                buffer->consumed = 0;
+                buffer->inbuf = 0;
+                buffer->scanned = 0;
+            }
+            return buffer->buf + start;
+        }
+        search = nl + 1; // a bare '\n' does not end a network message
+    }
+    buffer->scanned = buffer->inbuf;
+    return NULL;
 }
 
 /* Removes consumed characters from the buffer and shifts the rest
  * to make space for new characters.
  */
 void shift_buffer(Buffer * buffer){
-
-
-    return;
+    int remaining = buffer->inbuf - buffer->consumed;
+    if(buffer->consumed == 0){
+        return;
+    }
+    if(remaining > 0){
+        memmove(buffer->buf, buffer->buf + buffer->consumed, remaining);
+    }
+    buffer->scanned -= buffer->consumed;
+    if(buffer->scanned < 0){
+        buffer->scanned = 0;
+    }
+    buffer->inbuf = remaining;
+    buffer->consumed = 0;
 }
 
 /* Returns 1 if buffer is full, 0 otherwise.
  */
 int is_buffer_full(Buffer * buffer){
 
-    if(buffer->inbuf == BUFSIZE){
+    if(buffer->inbuf - buffer->consumed >= BUF_MAX){
         return 1;
     }
     return 0;
 }
+
+/* Initializes an empty buffer with no storage.
+ */
+void init_buffer(Buffer *buffer){
+    buffer->buf = NULL;
+    buffer->size = 0;
+    reset_buffer(buffer);
+}
+
+/* Empties the buffer, dropping any partial message.
+ */
+void reset_buffer(Buffer * buffer){
+    buffer->consumed = 0;
+    buffer->inbuf = 0;
+    buffer->scanned = 0;
+    buffer->discarding = 0;
+}
+
+/* Empties the buffer, and drops the rest of the current line as it is
+ * read, up to and including its newline.
+ */
+void discard_line(Buffer *buffer){
+    reset_buffer(buffer);
+    buffer->discarding = 1;
+}
+
+/* Returns the buffer's storage to its pool if it holds no bytes, so an
+ * idle buffer takes no memory. Messages found in it become invalid.
+ */
+void trim_buffer(Buffer *buffer){
+    if(buffer->buf != NULL && buffer->consumed == buffer->inbuf){
+        int discarding = buffer->discarding;
+        free_buffer(buffer);
+        buffer->discarding = discarding;
+    }
+}
+
+/* Returns the buffer's storage to its pool, dropping any bytes in it.
+ */
+void free_buffer(Buffer *buffer){
+    if(buffer->buf != NULL){
+        pool_free(buffer_pool(buffer->size), buffer->buf);
+    }
+    init_buffer(buffer);
+}
+
+/* Drops the next n unconsumed bytes of the buffer.
+ */
+void skip_buffer(Buffer *buffer, int n){
+    buffer->consumed += n;
+    if(buffer->scanned < buffer->consumed){
+        buffer->scanned = buffer->consumed;
+    }
+    if(buffer->consumed == buffer->inbuf){
+        reset_buffer(buffer);
+    }
+}
+
+/* Stores a 32 bit integer in network byte order.
+ */
+void bin_put_u32(char *dest, uint32_t value){
+    uint32_t net = htonl(value);
+    memcpy(dest, &net, sizeof(net));
+}
+
+/* Loads a 32 bit integer stored in network byte order.
+ */
+uint32_t bin_get_u32(const char *src){
+    uint32_t net;
+    memcpy(&net, src, sizeof(net));
+    return ntohl(net);
+}
+
+/* Fills in header and points payload at the next binary message in the
+ * buffer, and consumes it. The payload is valid until the next call to
+ * read_to_buf. Returns 1 if a message was found, 0 if none is complete
+ * yet, or -1 if the next message is longer than BIN_PAYLOAD_MAX.
+ */
+int get_next_frame(Buffer *buffer, BinHeader *header, char **payload){
+    int available = buffer->inbuf - buffer->consumed;
+    if(available < BIN_HEADER_SIZE){
+        return 0;
+    }
+    unsigned char *start = (unsigned char *)buffer->buf + buffer->consumed;
+    header->opcode = start[0];
+    header->status = start[1];
+    header->request_id = bin_get_u32((char *)start + 4);
+    header->length = bin_get_u32((char *)start + 8);
+    if(header->length > BIN_PAYLOAD_MAX){
+        return -1;
+    }
+    if(available < BIN_HEADER_SIZE + (int)header->length){
+        return 0;
+    }
+    *payload = (char *)start + BIN_HEADER_SIZE;
+    // Consumed without resetting, so the payload is not overwritten before
+    // the next read
+    buffer->consumed += BIN_HEADER_SIZE + header->length;
+    buffer->scanned = buffer->consumed;
+    return 1;
+}
+
+/* Allocates a chunk holding a binary message header, with room for
+ * payload_len bytes of payload after it, and len counting them.
+ * Returns NULL if it could not be allocated.
+ */
+Chunk *bin_chunk_new(int opcode, int status, uint32_t request_id, int payload_len){
+    Chunk *chunk = chunk_new(BIN_HEADER_SIZE + payload_len);
+    if(chunk == NULL){
+        return NULL;
+    }
+    chunk->data[0] = opcode;
+    chunk->data[1] = status;
+    chunk->data[2] = 0;
+    chunk->data[3] = 0;
+    bin_put_u32(chunk->data + 4, request_id);
+    bin_put_u32(chunk->data + 8, payload_len);
+    chunk->len = BIN_HEADER_SIZE + payload_len;
+    return chunk;
+}
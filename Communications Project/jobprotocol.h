@@ -1,6 +1,15 @@
 #ifndef __JOB_PROTOCOL_H__
 #define __JOB_PROTOCOL_H__
 
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "reactor.h"
+#include "outqueue.h"
+#include "pool.h"
+
 #ifndef PORT
   #define PORT 55555
 #endif
@@ -9,38 +18,185 @@
     #define MAX_JOBS 32
 #endif
 
-// No paths or lines may be larger than the BUFSIZE below
+// The job table starts with 1 << JOB_TABLE_MIN_BITS slots and doubles
+// whenever it would become more than half full.
+#define JOB_TABLE_MIN_BITS 6
+
+// Number of independently locked job lists that jobs are spread across
+#ifndef JOB_SHARDS
+    #define JOB_SHARDS 16
+#endif
+
+// Lines of recent output each job keeps to replay to new watchers (at
+// least 1), and the most bytes of it kept over all jobs
+#ifndef JOB_HISTORY_LINES
+    #define JOB_HISTORY_LINES 64
+#endif
+#ifndef JOB_HISTORY_BYTES
+    #define JOB_HISTORY_BYTES (4 << 20)
+#endif
+
+// Longest job program name kept, for listings and accounting
+#define JOB_NAME_MAX 32
+
+// No paths may be larger than the BUFSIZE below. Buffers start at BUFSIZE
+// bytes and double as needed to hold a line of up to BUF_MAX bytes, which
+// must be BUFSIZE times a power of two, at most BUFSIZE << (BUF_CLASSES - 1).
 #define BUFSIZE 256
+#define BUF_CLASSES 9
+#ifndef BUF_MAX
+    #define BUF_MAX (16 << 10)
+#endif
+#if BUF_MAX < BUFSIZE || BUF_MAX > (BUFSIZE << (BUF_CLASSES - 1)) || (BUF_MAX & (BUF_MAX - 1)) != 0
+    #error "BUF_MAX must be BUFSIZE times a power of two"
+#endif
 
 // TODO: Add any extern variable declarations or struct declarations needed.
 
 
+// Most words a text command may have, its name included: as many as fit
+// in a line of BUF_MAX bytes
+#define CMD_WORDS_MAX (BUF_MAX / 2 + 1)
+
 #define CMD_INVALID -1
-typedef enum {CMD_LISTJOBS, CMD_RUNJOB, CMD_KILLJOB, CMD_WATCHJOB,CMD_EXIT} JobCommand;
-static const int n_job_commands = 5;
+// Every JobCommand, in opcode order, with its name in the text protocol
+// and the fewest and most words that may follow the name there. The enum,
+// the names and the text parser's tables are all generated from this list.
+#define JOB_COMMANDS(X) \
+        X(CMD_LISTJOBS, "jobs", 0, 1) \
+        X(CMD_RUNJOB, "run", 1, CMD_WORDS_MAX - 1) \
+        X(CMD_KILLJOB, "kill", 1, 1) \
+        X(CMD_WATCHJOB, "watch", 1, 2) \
+        X(CMD_EXIT, "exit", 0, 0) \
+        X(CMD_STATS, "stats", 0, 0) \
+        X(CMD_COALESCE, "coalesce", 1, 2)
+#define JOB_COMMAND_ENUM(command, name, min_args, max_args) command,
+typedef enum {JOB_COMMANDS(JOB_COMMAND_ENUM) N_JOB_COMMANDS} JobCommand;
+static const int n_job_commands = N_JOB_COMMANDS;
 // See here for explanation of enums in C: https://www.geeksforgeeks.org/enumeration-enum-c/
 
 typedef enum {NEWLINE_CRLF, NEWLINE_LF} NewlineType;
 
+/* Binary protocol. A client that sends BIN_MAGIC as the first bytes on its
+ * connection speaks it from then on, and the server answers with the same
+ * magic. Every message is then a BIN_HEADER_SIZE byte header followed by
+ * length bytes of payload, all integers in network byte order:
+ *
+ *   opcode (1)  status (1)  reserved (2)  request id (4)  length (4)
+ *
+ * Requests carry a JobCommand opcode. CMD_RUNJOB's payload is the job name
+ * and its arguments, each null-terminated; CMD_KILLJOB's and
+ * CMD_WATCHJOB's is a pid; CMD_COALESCE's is a latency budget in
+ * microseconds and a byte budget, 0 for the server's default. Every
+ * request gets a reply with the same opcode and request id and a
+ * BinStatus: CMD_LISTJOBS with the pids of all jobs,
+ * CMD_RUNJOB and CMD_KILLJOB with a pid, CMD_WATCHJOB with a pid and
+ * 1 if now watching or 0 if not, CMD_STATS with the server's metrics
+ * in the Prometheus text format, and CMD_COALESCE with the latency budget
+ * in microseconds and byte budget now in effect. Events are sent with
+ * request id 0.
+ *
+ * A CMD_RUNJOB request's status is its priority. When every job slot is
+ * taken it is queued: the first reply has BIN_QUEUED and the request's
+ * ticket, and a second reply with the same request id follows once it
+ * starts, with BIN_OK and a pid, or BIN_FAILED.
+ */
+#define BIN_MAGIC "\0JOB"
+#define BIN_MAGIC_LEN 4
+#define BIN_HEADER_SIZE 12
+#define BIN_PAYLOAD_MAX (BUFSIZE - BIN_HEADER_SIZE)
+
+typedef enum {PROTO_UNKNOWN, PROTO_TEXT, PROTO_BINARY} Protocol;
+
+typedef enum {BIN_OK, BIN_NOT_FOUND, BIN_MAXJOBS, BIN_INVALID, BIN_FAILED,
+              BIN_QUEUED} BinStatus;
+
+// Payloads: pid and line for output, pid for BIN_EV_BUFFER_FULL, none for
+// BIN_EV_SHUTDOWN, and for BIN_EV_EXITED the pid, wait status, user and
+// system CPU time in milliseconds, max RSS in KB, and voluntary and
+// involuntary context switches
+typedef enum {BIN_EV_STDOUT = 0x80, BIN_EV_STDERR, BIN_EV_BUFFER_FULL,
+              BIN_EV_EXITED, BIN_EV_SHUTDOWN} BinEvent;
+
+struct bin_header {
+        int opcode;
+        int status;
+        uint32_t request_id;
+        uint32_t length;
+};
+typedef struct bin_header BinHeader;
+
 #define PIPE_READ 0
 #define PIPE_WRITE 1
 
+/* Bytes read from a client or job, framed into messages in place. The
+ * storage comes from buffer_pools and is only held while bytes are in it.
+ */
 struct job_buffer {
-        char buf[BUFSIZE];
-        int consumed;
-        int inbuf;
+        char *buf;      // NULL while the buffer holds no storage
+        int size;       // bytes of storage
+        int consumed;   // start of the first unconsumed message
+        int inbuf;      // end of the bytes read so far
+        int scanned;    // bytes before this were searched for a newline
+        int discarding; // dropping the rest of an over-long line
 };
 typedef struct job_buffer Buffer;
 
+struct reactor;
+struct raw_watcher;
+struct watcher_node;
+
+/* A connected client. Its buffer and list links are only used by the
+ * thread of the reactor that owns it; outq and closing can also be used by
+ * the thread announcing job output, and are guarded by lock. It is freed
+ * once its reactor has removed it and no other thread holds a reference.
+ */
 struct client {
         int socket_fd;
         struct job_buffer buffer;
+        struct event_source event;
+        struct reactor *reactor;
+        pthread_mutex_t lock;
+        int protocol;                   // Protocol, known after the first bytes
+        struct raw_watcher *raw_watchers;       // guarded by lock
+        struct watcher_node *watching;  // jobs it watches, guarded by lock
+        int queued_runs;                // run requests it has queued
+        long run_turn;                  // when a queued run of it last started
+        struct out_queue outq;
+        int coalesce_us;                // watched output may wait this long, 0 for none
+        int coalesce_bytes;             // or until this many bytes are queued
+        long flush_deadline;            // guarded by coalesce_lock, 0 if none due
+        struct client *coalesce_next;   // guarded by coalesce_lock
+        struct client **coalesce_link;  // link pointing to it, guarded by coalesce_lock
+        struct client *flush_next;      // next client reactor 0 is to flush
+        int refs;                       // its reactor's and those of other threads
+        int closing;                    // set once the client must be closed
+        int close_queued;               // on its reactor's list to be closed
+        struct client *close_next;      // next client waiting to be closed
+        struct client *prev;
+        struct client *next;
 };
 typedef struct client Client;
 
+struct client_list {
+        struct client *first;
+        int count;
+};
+typedef struct client_list ClientList;
+
+/* A client watching a job. Each node is on two doubly linked lists: its
+ * job's watcher list, guarded by the job's shard lock, and its client's
+ * watching list, guarded by the client's lock. Either side can unlink it
+ * without searching, so a client leaving or a job ending only visits its
+ * own subscriptions.
+ */
 struct watcher_node {
-        int client_fd;
+        struct client *client;
+        struct job_node *job;
+        struct watcher_node *prev;
         struct watcher_node *next;
+        struct watcher_node *client_prev;
+        struct watcher_node *client_next;
 };
 typedef struct watcher_node WatcherNode;
 
@@ -50,36 +206,144 @@ struct watcher_list {
 };
 typedef struct watcher_list WatcherList;
 
+/* A client watching a job's raw stdout. The job's output is duplicated
+ * into pipe with tee() and moved from there to the client's socket with
+ * splice(), so it never passes through user space. Linked from the job
+ * while it runs, and from the client until the pipe is drained.
+ */
+struct raw_watcher {
+        struct client *client;
+        int pipe[2];
+        int detached;                   // the job is gone; free once drained
+        int job_pid;
+        struct raw_watcher *job_next;
+        struct raw_watcher *client_next;
+};
+typedef struct raw_watcher RawWatcher;
+
+/* A line of job output as sent to text watchers, eg. "[JOB 7] hi\r\n".
+ */
+struct history_entry {
+        struct msg_chunk *chunk;
+        int prefix_len;                 // length of the "[JOB %d] " prefix
+        int is_stderr;
+};
+
+/* Ring of the most recent lines of a job's output.
+ */
+struct job_history {
+        struct history_entry entries[JOB_HISTORY_LINES];
+        int head;                       // oldest entry
+        int count;
+};
+
 struct job_node {
         int pid;
+        int pidfd;
         int stdout_fd;
         int stderr_fd;
         int dead;
         int wait_status;
+        char name[JOB_NAME_MAX];        // program name, eg. "randprint"
+        struct timespec started;        // on the monotonic clock
+        struct rusage usage;            // set once the job is reaped
         struct job_buffer stdout_buffer;
         struct job_buffer stderr_buffer;
+        struct event_source stdout_event;
+        struct event_source stderr_event;
         struct watcher_list watcher_list;
+        struct raw_watcher *raw_watchers;
+        struct job_history history;
+        struct job_node* prev;
         struct job_node* next;
 };
 typedef struct job_node JobNode;
 
-
+/* Jobs are indexed by pid in an open addressing hash table with linear
+ * probing, and also linked in the order they were added for iteration.
+ */
 struct job_list {
         struct job_node* first;
+        struct job_node* last;
         int count;
+        struct job_node** slots;
+        int bits;               // the table has 1 << bits slots
 };
 typedef struct job_list JobList;
 
+/* Every job of the server, spread by pid over JOB_SHARDS job lists that
+ * each have their own lock, so threads working on different jobs rarely
+ * wait for each other. count is the number of jobs over all shards.
+ */
+struct job_table {
+        struct job_list shards[JOB_SHARDS];
+        pthread_mutex_t locks[JOB_SHARDS];
+        int count;
+};
+typedef struct job_table JobTable;
+
+// Job and watcher nodes come from these pools rather than the heap, so
+// running and watching jobs does no heap allocation once they have grown
+extern Pool job_pool;
+extern Pool watcher_pool;
+
+// Buffer storage, one pool for each size from BUFSIZE to BUF_MAX
+extern Pool buffer_pools[BUF_CLASSES];
+
+// Text protocol name of each JobCommand
+extern const char *job_command_names[N_JOB_COMMANDS];
+
+/* Returns the JobCommand named by the len bytes at name, or CMD_INVALID if
+ * there is none.
+ */
+JobCommand find_job_command(const char *, int);
+
 /* Returns the specific JobCommand enum value related to the
- * input str. Returns CMD_INVALID if no match is found.
+ * input str, which is matched up to its first space. Returns CMD_INVALID
+ * if no match is found.
  */
 JobCommand get_job_command(char*);
 
-/* Forks the process and launches a job executable. Allocates a
- * JobNode containing PID, stdout and stderr pipes, and returns
- * it. Returns NULL if the JobNode could not be created.
+/* Allocates a JobNode for a job the zygote has started, taking over its
+ * pidfd and the read ends of its stdout and stderr pipes, which are made
+ * non-blocking. The first argument is the program's path or name.
+ * Returns NULL if the JobNode could not be allocated.
+ */
+JobNode* new_job(const char *, int, int, int, int);
+
+/* Initializes an empty job list.
+ */
+void init_job_list(JobList*);
+
+/* Returns the job with the given pid in the list, or NULL if not found.
+ */
+JobNode* find_job(JobList*, int);
+
+/* Initializes an empty job table.
+ */
+void init_job_table(JobTable*);
+
+/* Locks the shard of the job table that holds, or would hold, the given
+ * pid, and returns it.
+ */
+JobList* lock_job_shard(JobTable*, int);
+
+/* Unlocks the shard of the job table locked by lock_job_shard.
+ */
+void unlock_job_shard(JobTable*, int);
+
+/* Reserves room for one more job in the table.
+ * Returns 0 on success, or -1 if MAX_JOBS jobs are already reserved.
  */
-JobNode* start_job(char *, char * const[]);
+int reserve_job_slot(JobTable*);
+
+/* Gives back room reserved with reserve_job_slot.
+ */
+void release_job_slot(JobTable*);
+
+/* Frees every job in every shard of the table.
+ */
+void empty_job_table(JobTable*);
 
 /* Adds the given job to the given list of jobs.
  * Returns 0 on success, -1 otherwise.
@@ -97,17 +361,19 @@ int kill_job(JobList*, int);
  */
 int remove_job(JobList*, int);
 
-/* Marks a job as dead.
+/* Marks a job as dead with the wait status it exited with and the
+ * resources it used.
  * Returns 0 on success, or -1 if not found.
  */
-int mark_job_dead(JobList*, int, int);
+int mark_job_dead(JobList*, int, int, struct rusage *);
 
 /* Frees all memory held by a job list and resets it.
  * Returns 0 on success, -1 otherwise.
  */
 int empty_job_list(JobList*);
 
-/* Frees all memory held by a job node and its children.
+/* Frees all memory held by a job node and its watchers, and closes
+ * its pipes.
  */
 int delete_job_node(JobNode*);
 
@@ -120,39 +386,49 @@ int kill_all_jobs(JobList *);
  */
 int kill_job_node(JobNode *);
 
-/* Adds the given watcher to the given list of watchers.
+/* Adds the given client to the watchers of the given job. The job's shard
+ * must be locked, and the client must not be.
  * Returns 0 on success, -1 otherwise.
  */
-int add_watcher(WatcherList*, int);
+int add_watcher(JobNode*, Client*);
+
+/* Unlinks a watcher from its job and its client and frees it from memory.
+ * The job's shard must be locked, and the client must not be.
+ */
+void remove_watcher(WatcherNode*);
 
-/* Removes a watcher from the given watcher list and frees it from memory.
- * Returns 0 if successful, or 1 if not found.
+/* Returns the client's watcher of the job with the given pid, or NULL if
+ * it is not watching it. The client's watching list is walked under its
+ * lock, which must not be held already. Watchers are only freed with
+ * their job's shard locked, so a caller holding that lock may keep using
+ * the watcher after the client lock is released.
  */
-int remove_watcher(WatcherList*, int);
+WatcherNode *find_watcher(Client*, int);
 
-/* Removes a client from every watcher list in the given job list.
+/* Removes a client from the watcher list of every job it watches. Only
+ * the client's own subscriptions are visited.
  */
-void remove_client_from_all_watchers(JobList*, int);
+void remove_client_from_all_watchers(JobTable*, Client*);
 
-/* Adds the given watcher to a given job pid.
+/* Adds the given client as a watcher of a given job pid.
  * Returns 0 on success, 1 if job was not found, or -1 if watcher could not
  * be allocated.
  */
+int add_watcher_by_pid(JobList*, int, Client*);
 
-int add_watcher_by_pid(JobList*, int, int);
-
-/* Removes the given watcher from the list of a given job pid.
- * Returns 0 on success, 1 if job was not found, or 2 if client_fd could
- * not be found in list of watchers.
+/* Removes the given client from the watchers of a given job pid.
+ * Returns 0 on success, 1 if job was not found, or 2 if the client was
+ * not watching it.
  */
-int remove_watcher_by_pid(JobList*, int, int);
+int remove_watcher_by_pid(JobList*, int, Client*);
 
 /* Frees all memory held by a watcher list and resets it.
  * Returns 0 on success, -1 otherwise.
  */
 int empty_watcher_list(WatcherList *);
 
-/* Frees all memory held by a watcher node and its children.
+/* Frees all memory held by a watcher node and its children, unlinking
+ * each from its client.
  */
 int delete_watcher_node(WatcherNode *);
 
@@ -181,14 +457,33 @@ int find_network_newline(const char *, int);
  */
 int find_unix_newline(const char *, int);
 
+/* Keeps a reference to a line of the job's output in its history, dropping
+ * its oldest lines when it has JOB_HISTORY_LINES, or when all histories
+ * together would hold more than JOB_HISTORY_BYTES. The line is not kept if
+ * it does not fit even then.
+ */
+void history_push(JobNode *, Chunk *, int, int);
+
+/* Drops every line of the job's history.
+ */
+void history_clear(JobNode *);
+
 /* Read as much as possible from file descriptor fd into the given buffer.
- * Returns number of bytes read, or 0 if fd closed, or -1 on error.
+ * New bytes are appended after any partial message already in the buffer,
+ * which grows when a message does not fit. Returns number of bytes read,
+ * or 0 if fd closed, or -1 on error. If the buffer holds BUF_MAX bytes
+ * without a complete message, returns -1 with errno set to ENOBUFS.
  */
 int read_to_buf(int, Buffer*);
 
+/* Same as read_to_buf, reading no more than max bytes.
+ */
+int read_to_buf_max(int, Buffer*, int);
+
 /* Returns a pointer to the next message in the buffer, sets msg_len to
  * the length of characters in the message, with the given newline type.
- * Returns NULL if no message is left.
+ * Returns NULL if no message is left. The message is null-terminated in
+ * place and is valid until the next call to read_to_buf.
  */
 char* get_next_msg(Buffer*, int*, NewlineType);
 
@@ -201,4 +496,51 @@ void shift_buffer(Buffer *);
  */
 int is_buffer_full(Buffer *);
 
+/* Initializes an empty buffer with no storage.
+ */
+void init_buffer(Buffer *);
+
+/* Empties the buffer, dropping any partial message.
+ */
+void reset_buffer(Buffer *);
+
+/* Empties the buffer, and drops the rest of the current line as it is
+ * read, up to and including its newline.
+ */
+void discard_line(Buffer *);
+
+/* Returns the buffer's storage to its pool if it holds no bytes, so an
+ * idle buffer takes no memory. Messages found in it become invalid.
+ */
+void trim_buffer(Buffer *);
+
+/* Returns the buffer's storage to its pool, dropping any bytes in it.
+ */
+void free_buffer(Buffer *);
+
+/* Drops the next n unconsumed bytes of the buffer.
+ */
+void skip_buffer(Buffer *, int);
+
+/* Fills in header and points payload at the next binary message in the
+ * buffer, and consumes it. The payload is valid until the next call to
+ * read_to_buf. Returns 1 if a message was found, 0 if none is complete
+ * yet, or -1 if the next message is longer than BIN_PAYLOAD_MAX.
+ */
+int get_next_frame(Buffer*, BinHeader*, char**);
+
+/* Allocates a chunk holding a binary message header, with room for
+ * payload_len bytes of payload after it, and len counting them.
+ * Returns NULL if it could not be allocated.
+ */
+Chunk* bin_chunk_new(int, int, uint32_t, int);
+
+/* Stores a 32 bit integer in network byte order.
+ */
+void bin_put_u32(char *, uint32_t);
+
+/* Loads a 32 bit integer stored in network byte order.
+ */
+uint32_t bin_get_u32(const char *);
+
 #endif
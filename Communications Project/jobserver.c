@@ -1,427 +1,2949 @@
+#define _GNU_SOURCE // splice, tee, pipe2, F_SETPIPE_SZ
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <signal.h>
+#include <pthread.h>
 #include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <limits.h>
+#include <sys/pidfd.h>
 
 #include "socket.h"
 #include "jobprotocol.h"
+#include "metrics.h"
+#include "zygote.h"
+#include "log.h"
+#include "parser.h"
 
-#define QUEUE_LENGTH 5
-#define MAX_CLIENTS 20
+// Default length of each listening socket's queue of pending connections,
+// which the kernel caps at net.core.somaxconn; set with -b
+#ifndef QUEUE_LENGTH
+    #define QUEUE_LENGTH SOMAXCONN
+#endif
+#ifndef MAX_CLIENTS
+    #define MAX_CLIENTS 20
+#endif
+
+// Most reactor threads that can be asked for with -t
+#define MAX_REACTORS 256
+
+// Bytes a client may have queued before SLOW_CLIENT_POLICY applies
+#ifndef OUTQ_HIGH_WATER
+    #define OUTQ_HIGH_WATER (1 << 20)
+#endif
+
+// What to do with job output for a watcher over OUTQ_HIGH_WATER: close the
+// client, or drop the output it cannot keep up with. Clients that stop
+// reading their own command replies are always closed.
+#define SLOW_CLIENT_DISCONNECT 0
+#define SLOW_CLIENT_DROP 1
+#ifndef SLOW_CLIENT_POLICY
+    #define SLOW_CLIENT_POLICY SLOW_CLIENT_DISCONNECT
+#endif
+
+// Watched job output may be held back for up to WATCH_COALESCE_US
+// microseconds, or until WATCH_COALESCE_BYTES are queued, so a chatty job
+// reaches its watchers in fewer and fuller writes. These are the defaults
+// for new clients, set with -c; each client can change its own with the
+// coalesce command, and a budget of 0 sends output at once.
+#ifndef WATCH_COALESCE_US
+    #define WATCH_COALESCE_US 1000
+#endif
+#ifndef WATCH_COALESCE_BYTES
+    #define WATCH_COALESCE_BYTES 16384
+#endif
+#define COALESCE_US_MAX 1000000
+
+// Longest formatted job output prefix, eg. "*(JOB 4194304)* "
+#define JOB_PREFIX_MAX 32
+
+#ifndef JOBS_DIR
+    #define JOBS_DIR "jobs/"
+#endif
+
+// Results of run_client_job and submit_run. A job is only known to have
+// started once the zygote replies, and its client is told then.
+#define RUN_FAILED -1
+#define RUN_MAXJOBS -2
+#define RUN_QUEUED -3
+#define RUN_STARTING -4
+
+// Run requests are queued while MAX_JOBS jobs run, at most RUN_QUEUE_MAX
+// of them and RUN_QUEUE_PER_CLIENT from any one client. Priorities go from
+// 0, the default, to RUN_PRIORITIES - 1, which starts first.
+#ifndef RUN_QUEUE_MAX
+    #define RUN_QUEUE_MAX 64
+#endif
+#ifndef RUN_QUEUE_PER_CLIENT
+    #define RUN_QUEUE_PER_CLIENT 16
+#endif
+#define RUN_PRIORITIES 4
+
+// Programs whose jobs' resource use is totalled separately; jobs of any
+// more share the last entry
+#define MAX_JOB_TYPES 64
+
+// Results of toggle_watch, matching remove_watcher_by_pid
+#define WATCH_STOPPED 0
+#define WATCH_NOT_FOUND 1
+#define WATCH_STARTED 2
+
+/* One event loop thread. Each reactor has its own epoll instance and
+ * SO_REUSEPORT listening socket, and owns the clients it accepted. Job
+ * pipes and the SIGCHLD signalfd all belong to reactor 0, which runs on
+ * the main thread.
+ */
+struct reactor {
+        int id;
+        int epoll_fd;
+        int listen_fd;
+        int wakeup_fd;                  // eventfd written to stop the thread
+        EventSource listen_event;
+        EventSource wakeup_event;
+        ClientList clients;
+        Client *closing_clients;        // to close after the current batch
+        pthread_t thread;
+        Metrics metrics;                // only updated by this reactor's thread
+};
+typedef struct reactor Reactor;
+
+/* A run request waiting for a job slot.
+ */
+struct run_request {
+        Client *client;
+        int ticket;                     // told to the client when queued
+        int priority;
+        uint32_t request_id;            // of a binary request
+        struct run_request *next;
+        char *args[];                   // NULL-terminated, then the strings
+};
+typedef struct run_request RunRequest;
+
+/* Run requests in the order they arrived; see pick_run for the order they
+ * start in.
+ */
+struct run_queue {
+        RunRequest *first;
+        RunRequest **tail;              // link to append the next request at
+        int count;
+        int tickets;                    // last ticket handed out
+        long turns;                     // requests started so far
+};
+typedef struct run_queue RunQueue;
+
+/* Resources used by all finished jobs of one program. max_rss is the
+ * largest of any one job.
+ */
+struct job_type_usage {
+        char name[JOB_NAME_MAX];
+        long jobs;
+        double user;                    // CPU seconds
+        double sys;
+        long max_rss;                   // KB
+        long nvcsw;                     // context switches
+        long nivcsw;
+};
+typedef struct job_type_usage JobTypeUsage;
+
+/* A job the zygote has been asked to start. Its client is told once the
+ * zygote replies: with the ticket of its queued run request, or else as
+ * the reply to the command that asked for it.
+ */
+struct pending_spawn {
+        uint32_t id;
+        Client *client;                 // NULL once the client has gone
+        int ticket;                     // of a queued run request, or 0
+        uint32_t request_id;            // of a binary request
+        Chunk *reply;                   // slot reserved in the client's queue, or NULL
+        char name[JOB_NAME_MAX];
+        char *request;                  // for the zygote, until it is sent
+        int request_len;
+        struct pending_spawn *next;
+        struct pending_spawn *unsent_next;
+};
+typedef struct pending_spawn PendingSpawn;
+
+/* A child reaped before the zygote's reply about it was read, or one that
+ * failed to exec and is yet to be reaped.
+ */
+struct early_exit {
+        int pid;
+        int reaped;
+        int status;
+        struct rusage usage;
+        struct early_exit *next;
+};
+typedef struct early_exit EarlyExit;
+
+/* A connection to the metrics port, answered once its request has been
+ * read.
+ */
+struct scrape {
+        EventSource event;
+        int matched;                    // bytes of the blank line read so far
+};
+typedef struct scrape Scrape;
+
+// Global table of jobs, shared by all reactors
+JobTable job_table;
+
+// Reactor threads; reactors[0] runs on the main thread
+Reactor reactors[MAX_REACTORS];
+int num_reactors = 1;
+
+// The reactor run by the calling thread
+__thread Reactor *current_reactor;
+
+// The zygote, which starts jobs, and its socket, which reactor 0 reads its
+// replies from
+pid_t zygote_pid = -1;
+int zygote_fd = -1;
+EventSource zygote_event;
+
+// Guards pending_spawns, unsent_spawns and zygote_fd. Taken after the run
+// queue lock and before any shard or client.
+pthread_mutex_t spawns_lock = PTHREAD_MUTEX_INITIALIZER;
+PendingSpawn *pending_spawns;
+uint32_t spawn_ids;
+
+// Pending spawns whose requests the zygote's socket had no room for, oldest
+// first. Reactor 0 sends them once it has.
+PendingSpawn *unsent_spawns;
+PendingSpawn **unsent_tail = &unsent_spawns;
+
+// Only used by reactor 0, which reaps children and adds jobs
+EarlyExit *early_exits;
+
+// Number of connected clients over all reactors
+int client_count;
+
+// Options for the listening sockets: their backlog, set with -b, and the
+// seconds a connection may wait for its first command before the kernel
+// reports it, set with -d. Each connection is only logged with -v.
+int listen_backlog = QUEUE_LENGTH;
+int defer_accept;
+int log_connections;
+
+// Set with -s, which also logs every line the server has always printed,
+// in its old format, to compare output with earlier versions
+int compat_logging;
+
+// Guards run_queue and the queued_runs and run_turn of every client. Taken
+// before the spawns lock, any shard and any client.
+pthread_mutex_t run_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+RunQueue run_queue = {NULL, &(run_queue.first), 0, 0, 0};
+
+// Set when reactor 0 frees a job slot, and taken back by reactor 0 alone
+// once it has handled its batch of events
+int slot_freed;
+
+// Resources used by finished jobs, by program
+pthread_mutex_t job_types_lock = PTHREAD_MUTEX_INITIALIZER;
+JobTypeUsage job_types[MAX_JOB_TYPES];
+int num_job_types;
+
+// Per-client state, recycled between connections. Built with -DPOOL_STATS,
+// the server prints the counters of every pool on exit.
+Pool client_pool = POOL_INITIALIZER("client", Client, 16);
+Pool raw_watcher_pool = POOL_INITIALIZER("raw watcher", RawWatcher, 64);
+
+// Listening socket for Prometheus scrapes, given with -m, on reactor 0
+int metrics_fd = -1;
+EventSource metrics_event;
+
+// Coalescing budgets of new clients, set with -c
+int default_coalesce_us = WATCH_COALESCE_US;
+int default_coalesce_bytes = WATCH_COALESCE_BYTES;
+
+// Clients with watched output held back, and the timerfd on reactor 0 that
+// fires when the earliest of them is due. Guards the list and the
+// flush_deadline of every client. Taken after any shard and before any
+// client.
+pthread_mutex_t coalesce_lock = PTHREAD_MUTEX_INITIALIZER;
+Client *coalescing;
+int flush_timer_fd = -1;
+long flush_timer_deadline;      // 0 while disarmed
+EventSource flush_timer_event;
+
+// Flag to keep track of SIGINT received
+int sigint_received;
+
+// Raised by the main thread to stop the other reactors
+int shutting_down;
+
+/* SIGINT handler:
+ * We are just raising the sigint_received flag here. Our program will
+ * periodically check to see if this flag has been raised, and any necessary
+ * work will be done in main() and/or the helper functions. Write your signal
+ * handlers with care, to avoid issues with async-signal-safety.
+ */
+void sigint_handler(int code) {
+    sigint_received = 1;
+}
+
+
+/*
+ *  Client management
+ */
+
+/* Adds a newly accepted, non-blocking client socket to the reactor's list
+ * of clients, registered edge-triggered with the reactor. The socket is
+ * closed if the client cannot be added.
+ * Return the new client's file descriptor or -1 on error.
+ */
+int setup_new_client(Reactor *reactor, int client_fd){
+    if (__atomic_add_fetch(&client_count, 1, __ATOMIC_RELAXED) > MAX_CLIENTS) {
+        __atomic_sub_fetch(&client_count, 1, __ATOMIC_RELAXED);
+        log_warn("server: max concurrent connections\n");
+        metric_add(&(reactor->metrics.counters[MET_REJECTS]), 1);
+        close(client_fd);
+        return -1;
+    }
+
+    Client *client = pool_alloc(&client_pool);
+    if (client == NULL) {
+        __atomic_sub_fetch(&client_count, 1, __ATOMIC_RELAXED);
+        metric_add(&(reactor->metrics.counters[MET_REJECTS]), 1);
+        close(client_fd);
+        return -1;
+    }
+    client->socket_fd = client_fd;
+    // Replies are already gathered into one write per wakeup, and a job's
+    // start is told in a write of its own, which Nagle would hold back
+    // until the client acknowledged the last one
+    int on = 1;
+    if (setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) == -1) {
+        log_perror("setsockopt TCP_NODELAY");
+    }
+    client->reactor = reactor;
+    client->protocol = PROTO_UNKNOWN;
+    client->raw_watchers = NULL;
+    client->watching = NULL;
+    client->queued_runs = 0;
+    client->run_turn = 0;
+    init_buffer(&(client->buffer));
+    pthread_mutex_init(&(client->lock), NULL);
+    outq_init(&(client->outq));
+    client->coalesce_us = default_coalesce_us;
+    client->coalesce_bytes = default_coalesce_bytes;
+    client->flush_deadline = 0;
+    client->coalesce_next = NULL;
+    client->coalesce_link = NULL;
+    client->flush_next = NULL;
+    client->refs = 1;
+    client->closing = 0;
+    client->close_queued = 0;
+    client->close_next = NULL;
+    event_source_init(&(client->event), EV_CLIENT, client_fd, client);
+
+    if (reactor_add(reactor->epoll_fd, &(client->event), EPOLLIN | EPOLLOUT | EPOLLET) == -1) {
+        __atomic_sub_fetch(&client_count, 1, __ATOMIC_RELAXED);
+        metric_add(&(reactor->metrics.counters[MET_REJECTS]), 1);
+        close(client_fd);
+        pthread_mutex_destroy(&(client->lock));
+        pool_free(&client_pool, client);
+        return -1;
+    }
+    metric_add(&(reactor->metrics.counters[MET_ACCEPTS]), 1);
+
+    ClientList *clients = &(reactor->clients);
+    client->prev = NULL;
+    client->next = clients->first;
+    if (clients->first != NULL) {
+        clients->first->prev = client;
+    }
+    clients->first = client;
+    clients->count++;
+    return client_fd;
+}
+
+/* Accepts every connection pending on the reactor's listening socket, so a
+ * burst of them costs one wakeup. The socket is level-triggered, so any
+ * left after an error are tried again on the next iteration.
+ */
+void accept_clients(Reactor *reactor){
+    struct sockaddr_in peer;
+    while (1) {
+        int client_fd = accept_connection(reactor->listen_fd, &peer);
+        if (client_fd == -1) {
+            // The peer gave up while its connection was queued
+            if (errno == ECONNABORTED || errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_perror("accept");
+            }
+            return;
+        }
+        char address[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &(peer.sin_addr), address, sizeof(address));
+        if (compat_logging) {
+            // To stderr, where accept_connection used to print them
+            log_warn("Waiting for a new connection...\n");
+            log_warn("New connection accepted from %s:%d\n", address, ntohs(peer.sin_port));
+        }
+        if (setup_new_client(reactor, client_fd) == -1) {
+            continue;
+        }
+        if (compat_logging) {
+            log_info("Accepted connection\n");
+        }
+        else if (log_connections) {
+            log_info("Accepted connection from %s:%d\n", address, ntohs(peer.sin_port));
+        }
+    }
+}
+
+/* Takes a reference to the client, which keeps it from being freed.
+ */
+void client_ref(Client *client){
+    __atomic_add_fetch(&(client->refs), 1, __ATOMIC_RELAXED);
+}
+
+/* Drops a reference to the client, freeing it with the last one.
+ */
+void client_unref(Client *client){
+    if(__atomic_sub_fetch(&(client->refs), 1, __ATOMIC_ACQ_REL) > 0){
+        return;
+    }
+    outq_clear(&(client->outq));
+    free_buffer(&(client->buffer));
+    pthread_mutex_destroy(&(client->lock));
+    pool_free(&client_pool, client);
+}
+
+/* Removes a client from its reactor's list of clients and drops its
+ * reactor's reference to it. The caller is responsible for closing its
+ * socket, which also removes it from epoll.
+ */
+void remove_client(Client *client){
+    ClientList *clients = &(client->reactor->clients);
+    if(client->prev != NULL){
+        client->prev->next = client->next;
+    }
+    else{
+        clients->first = client->next;
+    }
+    if(client->next != NULL){
+        client->next->prev = client->prev;
+    }
+    clients->count--;
+    __atomic_sub_fetch(&client_count, 1, __ATOMIC_RELAXED);
+    // A thread still holding a reference must leave its socket alone, as
+    // the fd may already be reused
+    pthread_mutex_lock(&(client->lock));
+    client->closing = 1;
+    client->close_queued = 1;
+    pthread_mutex_unlock(&(client->lock));
+    client_unref(client);
+}
+
+/* Closes a raw watcher's pipe and frees it. It must already be unlinked
+ * from its job and client.
+ */
+void free_raw_watcher(RawWatcher *raw){
+    close(raw->pipe[PIPE_READ]);
+    close(raw->pipe[PIPE_WRITE]);
+    pool_free(&raw_watcher_pool, raw);
+}
+
+/* Unlinks the client's raw watcher from job_node and frees it. The job's
+ * shard must be locked.
+ * Returns 0 on success, or 2 if the client was not watching the job raw.
+ */
+int remove_raw_watcher(JobNode *job_node, Client *client){
+    RawWatcher **link = &(job_node->raw_watchers);
+    while(*link != NULL && (*link)->client != client){
+        link = &((*link)->job_next);
+    }
+    RawWatcher *raw = *link;
+    if(raw == NULL){
+        return 2;
+    }
+    *link = raw->job_next;
+    pthread_mutex_lock(&(client->lock));
+    RawWatcher **client_link = &(client->raw_watchers);
+    while(*client_link != raw){
+        client_link = &((*client_link)->client_next);
+    }
+    *client_link = raw->client_next;
+    pthread_mutex_unlock(&(client->lock));
+    free_raw_watcher(raw);
+    return 0;
+}
+
+/* Removes a client from the watcher lists of every job it watches, and
+ * frees all of its raw watchers. Only the client's own subscriptions are
+ * visited, not every job.
+ */
+void unwatch_all_jobs(JobTable *job_table, Client *client){
+    remove_client_from_all_watchers(job_table, client);
+    while(1){
+        // As with watchers, the pid is looked up before the shard is locked.
+        // A raw watcher is detached under its shard's lock before its job is
+        // removed, so each pass removes or skips one.
+        pthread_mutex_lock(&(client->lock));
+        RawWatcher *raw = client->raw_watchers;
+        while(raw != NULL && raw->detached){
+            raw = raw->client_next;
+        }
+        int pid = raw != NULL ? raw->job_pid : -1;
+        pthread_mutex_unlock(&(client->lock));
+        if(pid == -1){
+            break;
+        }
+        JobList *job_list = lock_job_shard(job_table, pid);
+        JobNode *job = find_job(job_list, pid);
+        if(job != NULL){
+            remove_raw_watcher(job, client);
+        }
+        unlock_job_shard(job_table, pid);
+    }
+    // Only those of finished jobs are left
+    pthread_mutex_lock(&(client->lock));
+    while(client->raw_watchers != NULL){
+        RawWatcher *raw = client->raw_watchers;
+        client->raw_watchers = raw->client_next;
+        free_raw_watcher(raw);
+    }
+    pthread_mutex_unlock(&(client->lock));
+}
+
+/* Drops every run request the client has queued.
+ */
+void drop_client_runs(Client *client){
+    pthread_mutex_lock(&run_queue_lock);
+    RunRequest **link = &(run_queue.first);
+    while(client->queued_runs > 0 && *link != NULL){
+        RunRequest *request = *link;
+        if(request->client == client){
+            *link = request->next;
+            if(*link == NULL){
+                run_queue.tail = link;
+            }
+            run_queue.count--;
+            client->queued_runs--;
+            free(request);
+        }
+        else{
+            link = &(request->next);
+        }
+    }
+    pthread_mutex_unlock(&run_queue_lock);
+}
+
+/* Forgets the client in the jobs being started for it, which still start.
+ */
+void drop_client_spawns(Client *client){
+    pthread_mutex_lock(&spawns_lock);
+    for(PendingSpawn *pending = pending_spawns; pending != NULL; pending = pending->next){
+        if(pending->client == client){
+            pending->client = NULL;
+        }
+    }
+    pthread_mutex_unlock(&spawns_lock);
+}
+
+/* Takes the client off the list of those with output held back, if it is
+ * on it. The coalesce lock must be held.
+ */
+void unlink_coalescing(Client *client){
+    if(client->flush_deadline == 0){
+        return;
+    }
+    *(client->coalesce_link) = client->coalesce_next;
+    if(client->coalesce_next != NULL){
+        client->coalesce_next->coalesce_link = client->coalesce_link;
+    }
+    client->flush_deadline = 0;
+}
+
+/* Takes the client off the list of those with output held back.
+ */
+void drop_client_coalesce(Client *client){
+    pthread_mutex_lock(&coalesce_lock);
+    unlink_coalescing(client);
+    pthread_mutex_unlock(&coalesce_lock);
+}
+
+/* Marks the client to be closed. Must be called without the client's lock.
+ * On the client's own reactor thread it is closed at the end of the current
+ * batch of events, so no event still pending for it refers to freed memory.
+ * From any other thread its socket is shut down, which wakes its reactor up
+ * to close it.
+ */
+void mark_client_closing(Client *client){
+    pthread_mutex_lock(&(client->lock));
+    int was_closing = client->closing;
+    client->closing = 1;
+    pthread_mutex_unlock(&(client->lock));
+    if(client->reactor == current_reactor){
+        if(!client->close_queued){
+            client->close_queued = 1;
+            client->close_next = current_reactor->closing_clients;
+            current_reactor->closing_clients = client;
+        }
+    }
+    else if(!was_closing){
+        shutdown(client->socket_fd, SHUT_RDWR);
+    }
+}
+
+/* Closes and frees every client of the reactor marked by
+ * mark_client_closing.
+ */
+void close_marked_clients(Reactor *reactor, JobTable *job_table){
+    while(reactor->closing_clients != NULL){
+        Client *client = reactor->closing_clients;
+        reactor->closing_clients = client->close_next;
+        int fd = client->socket_fd;
+        // No job or run request may refer to the client once it is freed
+        drop_client_runs(client);
+        drop_client_spawns(client);
+        unwatch_all_jobs(job_table, client);
+        // Only once it watches nothing can its output no longer be held back
+        drop_client_coalesce(client);
+        // Client Termination
+        if(close(fd) == -1){
+            log_perror("Closing Request Failed\n");
+        }
+        log_info("[CLIENT %d] Connection closed\n", fd);
+        remove_client(client);
+    }
+}
+
+/* Moves as much of the client's raw watch pipes to its socket as it
+ * accepts, and frees those whose job is gone once they are empty. Must be
+ * called with the client's lock held and its out queue empty, so raw
+ * bytes never land inside a queued reply.
+ * Returns 0 on success, or -1 if the client failed.
+ */
+int drain_raw_watchers(Client *client){
+    RawWatcher **link = &(client->raw_watchers);
+    while(*link != NULL){
+        RawWatcher *raw = *link;
+        ssize_t moved;
+        do{
+            moved = splice(raw->pipe[PIPE_READ], NULL, client->socket_fd, NULL,
+                           OUTQ_HIGH_WATER, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        } while(moved > 0 || (moved == -1 && errno == EINTR));
+        // EAGAIN if either the pipe is empty or the socket is full
+        if(moved == -1 && errno != EAGAIN){
+            return -1;
+        }
+        int pending;
+        if(raw->detached && ioctl(raw->pipe[PIPE_READ], FIONREAD, &pending) == 0 && pending == 0){
+            *link = raw->client_next;
+            free_raw_watcher(raw);
+            continue;
+        }
+        link = &(raw->client_next);
+    }
+    return 0;
+}
+
+/* Writes out as much of the client's queue as its socket accepts, then
+ * its raw watch output.
+ * Returns 0 on success, or -1 if the client failed.
+ */
+int flush_client(Client *client){
+    pthread_mutex_lock(&(client->lock));
+    int result = client->closing ? -1 : outq_flush(&(client->outq), client->socket_fd);
+    if(result == 0 && client->raw_watchers != NULL){
+        result = drain_raw_watchers(client);
+    }
+    pthread_mutex_unlock(&(client->lock));
+    if(result == -1){
+        mark_client_closing(client);
+        return -1;
+    }
+    return 0;
+}
+
+/* Queues chunk to the client. Replies to every command handled in one
+ * wakeup are written out together by the flush_client that ends it.
+ * Returns 0 on success, or -1 if the client failed or has more than
+ * OUTQ_HIGH_WATER bytes queued, in which case it is marked for closing.
+ */
+int send_to_client(Client *client, Chunk *chunk){
+    pthread_mutex_lock(&(client->lock));
+    int failed = client->closing || chunk == NULL ||
+                 client->outq.bytes + chunk->len > OUTQ_HIGH_WATER ||
+                 outq_push(&(client->outq), chunk) == -1;
+    pthread_mutex_unlock(&(client->lock));
+    if(failed){
+        mark_client_closing(client);
+        return -1;
+    }
+    return 0;
+}
+
+/* Reserves a place in the client's out queue for a reply that is not
+ * known yet. Replies to its later commands are queued after it and wait
+ * for it to be filled with fill_reply.
+ * Returns the slot, or NULL if the client failed, in which case it is
+ * marked for closing.
+ */
+Chunk *reserve_reply(Client *client){
+    pthread_mutex_lock(&(client->lock));
+    Chunk *slot = client->closing ? NULL : outq_reserve(&(client->outq));
+    pthread_mutex_unlock(&(client->lock));
+    if(slot == NULL){
+        mark_client_closing(client);
+    }
+    return slot;
+}
+
+/* Fills a slot from reserve_reply with chunk, or with nothing if chunk is
+ * NULL. The replies it held back go out with the next flush_client.
+ */
+void fill_reply(Client *client, Chunk *slot, Chunk *chunk){
+    pthread_mutex_lock(&(client->lock));
+    outq_fill(&(client->outq), slot, chunk);
+    pthread_mutex_unlock(&(client->lock));
+}
+
+/* Formats a reply and sends it to the client with send_to_client.
+ * Returns 0 on success, or -1 if the client is being closed.
+ */
+__attribute__((format(printf, 2, 3)))
+int send_reply(Client *client, const char *format, ...){
+    va_list args;
+    va_start(args, format);
+    Chunk *chunk = chunk_vprintf(format, args);
+    va_end(args);
+    int result = send_to_client(client, chunk);
+    if(chunk != NULL){
+        chunk_unref(chunk);
+    }
+    return result;
+}
+
+/* Compares two pids for qsort.
+ */
+int compare_pids(const void *a, const void *b){
+    return *(const int *)a - *(const int *)b;
+}
+
+/* Collects the pids of every job in ascending order into an array, which
+ * the caller must free.
+ * Returns the number of pids, or -1 if the array could not be allocated.
+ */
+int collect_job_pids(JobTable *job_table, int **pids_out){
+    int *pids = NULL;
+    int count = 0;
+    int capacity = 0;
+    for(int shard = 0; shard < JOB_SHARDS; shard++){
+        JobList *job_list = lock_job_shard(job_table, shard);
+        if(count + job_list->count > capacity){
+            capacity = 2 * (count + job_list->count);
+            int *grown = realloc(pids, capacity * sizeof(int));
+            if(grown == NULL){
+                unlock_job_shard(job_table, shard);
+                free(pids);
+                return -1;
+            }
+            pids = grown;
+        }
+        for(JobNode *current = job_list->first; current != NULL; current = current->next){
+            pids[count++] = current->pid;
+        }
+        unlock_job_shard(job_table, shard);
+    }
+    if(count > 0){
+        qsort(pids, count, sizeof(int), compare_pids);
+    }
+    *pids_out = pids;
+    return count;
+}
+
+/* Sends the client the pids of every job, in ascending order.
+ * Returns 0 on success, or -1 if the client is being closed.
+ */
+int send_job_list(Client *client, JobTable *job_table){
+    int *pids;
+    int count = collect_job_pids(job_table, &pids);
+    if(count == -1){
+        return 0;
+    }
+    if(count == 0){
+        free(pids);
+        return send_reply(client, "[SERVER] No currently running jobs\r\n");
+    }
+
+    // "[SERVER]", a space and pid per job, and "\r\n"
+    Chunk *msg = chunk_new(8 + count * 12 + 3);
+    if(msg == NULL){
+        free(pids);
+        return 0;
+    }
+    msg->len = sprintf(msg->data, "[SERVER]");
+    for(int i = 0; i < count; i++){
+        msg->len += sprintf(msg->data + msg->len, " %d", pids[i]);
+    }
+    msg->len += sprintf(msg->data + msg->len, "\r\n");
+    free(pids);
+    int sent = send_to_client(client, msg);
+    chunk_unref(msg);
+    return sent;
+}
+
+/* Returns a time from a struct rusage in seconds.
+ */
+double seconds(struct timeval time){
+    return time.tv_sec + time.tv_usec / 1e6;
+}
+
+/* Formats resource use into str, eg. "user 0.010s, sys 0.002s, max rss
+ * 1600 KB, 3 voluntary and 1 involuntary context switches".
+ */
+void describe_usage(char *str, int size, double user, double sys, long max_rss,
+                    long nvcsw, long nivcsw){
+    snprintf(str, size, "user %.3fs, sys %.3fs, max rss %ld KB, %ld voluntary "
+             "and %ld involuntary context switches", user, sys, max_rss, nvcsw, nivcsw);
+}
+
+/* Adds the resources a finished job used to the totals of its program.
+ */
+void account_job(JobNode *job_node){
+    struct rusage *usage = &(job_node->usage);
+    pthread_mutex_lock(&job_types_lock);
+    int i = 0;
+    while(i < num_job_types && strcmp(job_types[i].name, job_node->name) != 0){
+        i++;
+    }
+    if(i == num_job_types){
+        if(num_job_types < MAX_JOB_TYPES - 1){
+            num_job_types++;
+            snprintf(job_types[i].name, JOB_NAME_MAX, "%s", job_node->name);
+        }
+        else{
+            i = MAX_JOB_TYPES - 1;
+            if(num_job_types < MAX_JOB_TYPES){
+                num_job_types++;
+                snprintf(job_types[i].name, JOB_NAME_MAX, "(other)");
+            }
+        }
+    }
+    JobTypeUsage *type = &job_types[i];
+    type->jobs++;
+    type->user += seconds(usage->ru_utime);
+    type->sys += seconds(usage->ru_stime);
+    if(usage->ru_maxrss > type->max_rss){
+        type->max_rss = usage->ru_maxrss;
+    }
+    type->nvcsw += usage->ru_nvcsw;
+    type->nivcsw += usage->ru_nivcsw;
+    pthread_mutex_unlock(&job_types_lock);
+}
+
+/* A job as shown by jobs -v.
+ */
+struct job_detail {
+        int pid;
+        int dead;
+        double elapsed;
+        char name[JOB_NAME_MAX];
+};
+
+int compare_job_details(const void *a, const void *b){
+    return ((const struct job_detail *)a)->pid - ((const struct job_detail *)b)->pid;
+}
+
+/* Sends the client a line for each job with its pid, program, state and
+ * time since it started, by pid, then the resources used by the finished
+ * jobs of each program and of all of them.
+ * Returns 0 on success, -1 if the client is being closed.
+ */
+int send_job_details(Client *client, JobTable *job_table){
+    struct job_detail *details = NULL;
+    int count = 0;
+    int capacity = 0;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for(int shard = 0; shard < JOB_SHARDS; shard++){
+        JobList *job_list = lock_job_shard(job_table, shard);
+        if(count + job_list->count > capacity){
+            capacity = 2 * (count + job_list->count);
+            struct job_detail *grown = realloc(details, capacity * sizeof(struct job_detail));
+            if(grown == NULL){
+                unlock_job_shard(job_table, shard);
+                free(details);
+                return 0;
+            }
+            details = grown;
+        }
+        for(JobNode *current = job_list->first; current != NULL; current = current->next){
+            struct job_detail *detail = &details[count++];
+            detail->pid = current->pid;
+            detail->dead = current->dead;
+            detail->elapsed = (now.tv_sec - current->started.tv_sec) +
+                              (now.tv_nsec - current->started.tv_nsec) / 1e9;
+            memcpy(detail->name, current->name, JOB_NAME_MAX);
+        }
+        unlock_job_shard(job_table, shard);
+    }
+    int sent = 0;
+    if(count == 0){
+        sent = send_reply(client, "[SERVER] No currently running jobs\r\n");
+    }
+    else{
+        qsort(details, count, sizeof(struct job_detail), compare_job_details);
+    }
+    for(int i = 0; i < count && sent == 0; i++){
+        sent = send_reply(client, "[SERVER] %d %s %s %.3fs\r\n", details[i].pid, details[i].name,
+                          details[i].dead ? "exited" : "running", details[i].elapsed);
+    }
+    free(details);
+
+    char usage[160];
+    JobTypeUsage total = {"", 0, 0, 0, 0, 0, 0};
+    pthread_mutex_lock(&job_types_lock);
+    for(int i = 0; i < num_job_types && sent == 0; i++){
+        JobTypeUsage *type = &job_types[i];
+        describe_usage(usage, sizeof(usage), type->user, type->sys, type->max_rss,
+                       type->nvcsw, type->nivcsw);
+        sent = send_reply(client, "[SERVER] Finished %s: %ld jobs, %s\r\n", type->name,
+                          type->jobs, usage);
+        total.jobs += type->jobs;
+        total.user += type->user;
+        total.sys += type->sys;
+        total.max_rss = type->max_rss > total.max_rss ? type->max_rss : total.max_rss;
+        total.nvcsw += type->nvcsw;
+        total.nivcsw += type->nivcsw;
+    }
+    pthread_mutex_unlock(&job_types_lock);
+    if(total.jobs > 0 && sent == 0){
+        describe_usage(usage, sizeof(usage), total.user, total.sys, total.max_rss,
+                       total.nvcsw, total.nivcsw);
+        sent = send_reply(client, "[SERVER] Finished in total: %ld jobs, %s\r\n", total.jobs, usage);
+    }
+    return sent;
+}
+
+/* Returns the metrics of every reactor added up, along with the current
+ * number of clients, jobs and queued runs.
+ */
+void collect_metrics(Metrics *total){
+    memset(total, 0, sizeof(Metrics));
+    for(int i = 0; i < num_reactors; i++){
+        metrics_sum(total, &(reactors[i].metrics));
+    }
+    total->gauges[GAUGE_CLIENTS] = __atomic_load_n(&client_count, __ATOMIC_RELAXED);
+    total->gauges[GAUGE_JOBS] = __atomic_load_n(&(job_table.count), __ATOMIC_RELAXED);
+    total->gauges[GAUGE_QUEUED_RUNS] = __atomic_load_n(&(run_queue.count), __ATOMIC_RELAXED);
+}
+
+/* Formats the server's metrics into a chunk, in the Prometheus text
+ * format or as lines for the text protocol.
+ * Returns NULL if it could not be allocated.
+ */
+Chunk *metrics_chunk(int prometheus){
+    Metrics total;
+    collect_metrics(&total);
+    char *text;
+    size_t len;
+    FILE *stream = open_memstream(&text, &len);
+    if(stream == NULL){
+        log_perror("open_memstream");
+        return NULL;
+    }
+    if(prometheus){
+        metrics_write_prometheus(&total, stream);
+    }
+    else{
+        metrics_write_text(&total, stream);
+    }
+    fclose(stream);
+    Chunk *chunk = chunk_new(len);
+    if(chunk != NULL){
+        memcpy(chunk->data, text, len);
+        chunk->len = len;
+    }
+    free(text);
+    return chunk;
+}
+
+/* Asks the zygote to start the program at exe_file with args, for client.
+ * ticket is that of its queued run request, or 0 if the client is to be
+ * answered as for any other command, in which case the reply's place in
+ * its out queue is reserved now. The job is added once the zygote replies.
+ * Returns 0 on success, -1 on error.
+ */
+int request_spawn(Client *client, char *exe_file, char * const args[], int ticket,
+                  uint32_t request_id){
+    PendingSpawn *pending = malloc(sizeof(PendingSpawn));
+    if(pending == NULL){
+        log_perror("malloc pending spawn");
+        return -1;
+    }
+    pending->client = client;
+    pending->ticket = ticket;
+    pending->request_id = request_id;
+    pending->reply = NULL;
+    pending->unsent_next = NULL;
+    if(ticket == 0 && (pending->reply = reserve_reply(client)) == NULL){
+        free(pending);
+        return -1;
+    }
+    const char *name = strrchr(exe_file, '/');
+    snprintf(pending->name, JOB_NAME_MAX, "%s", name != NULL ? name + 1 : exe_file);
+    pthread_mutex_lock(&spawns_lock);
+    pending->id = ++spawn_ids;
+    pending->request = zygote_encode(pending->id, exe_file, args, &(pending->request_len));
+    // Sent with the lock held, so the reply cannot be handled before the
+    // request is pending. Requests already waiting for room go first.
+    int sent = -1;
+    if(zygote_fd != -1 && pending->request != NULL){
+        sent = unsent_spawns != NULL ? 0 :
+               zygote_send(zygote_fd, pending->request, pending->request_len);
+    }
+    if(sent == -1){
+        pthread_mutex_unlock(&spawns_lock);
+        if(pending->reply != NULL){
+            fill_reply(client, pending->reply, NULL);
+        }
+        free(pending->request);
+        free(pending);
+        return -1;
+    }
+    if(sent == 1){
+        free(pending->request);
+        pending->request = NULL;
+    }
+    else{
+        *unsent_tail = pending;
+        unsent_tail = &(pending->unsent_next);
+    }
+    pending->next = pending_spawns;
+    pending_spawns = pending;
+    pthread_mutex_unlock(&spawns_lock);
+    return 0;
+}
+
+/* Starts the program in JOBS_DIR named by command_args[0], with the rest of
+ * the NULL-terminated command_args as its arguments, for client. ticket and
+ * request_id are as for request_spawn. command_args[0] is replaced with the
+ * program's path.
+ * Returns RUN_STARTING once the zygote has been asked to start it,
+ * RUN_MAXJOBS if MAX_JOBS jobs are running, or RUN_FAILED if there is no
+ * such program or it could not be started.
+ */
+int run_client_job(JobTable *job_table, Client *client, char **command_args, int ticket,
+                   uint32_t request_id){
+    char exe_file[BUFSIZE];
+    struct stat statbuff;
+    if(command_args[0] == NULL ||
+       snprintf(exe_file, BUFSIZE, "%s%s", JOBS_DIR, command_args[0]) >= BUFSIZE ||
+       lstat(exe_file, &statbuff) == -1){
+        return RUN_FAILED;
+    }
+    if(reserve_job_slot(job_table) == -1){
+        return RUN_MAXJOBS;
+    }
+    command_args[0] = exe_file;
+    if(request_spawn(client, exe_file, command_args, ticket, request_id) == -1){
+        release_job_slot(job_table);
+        return RUN_FAILED;
+    }
+    return RUN_STARTING;
+}
+
+/* Sends SIGKILL to the job with the given pid.
+ * Returns 0 on success, 1 if there is no such job, or -1 on error.
+ */
+int kill_job_by_pid(JobTable *job_table, int pid){
+    JobList *job_list = lock_job_shard(job_table, pid);
+    int killed_job = kill_job(job_list, pid);
+    unlock_job_shard(job_table, pid);
+    // on success the job is removed once it is reaped and its pipes are closed
+    return killed_job;
+}
+
+/* Builds the notice of a run for client, in its protocol: that it is
+ * queued as ticket when pid is RUN_QUEUED, that it started as job pid, or
+ * that it failed when pid is RUN_FAILED. ticket is 0 for a run that was
+ * not queued, which is answered like any other command.
+ * Returns NULL if it could not be allocated.
+ */
+Chunk *run_notice(Client *client, int ticket, uint32_t request_id, int pid){
+    if(client->protocol == PROTO_BINARY){
+        int status = pid == RUN_QUEUED ? BIN_QUEUED : pid == RUN_FAILED ? BIN_FAILED : BIN_OK;
+        int value = pid == RUN_QUEUED ? ticket : pid;
+        Chunk *chunk = bin_chunk_new(CMD_RUNJOB, status, request_id,
+                                     status == BIN_FAILED ? 0 : 4);
+        if(chunk != NULL && status != BIN_FAILED){
+            bin_put_u32(chunk->data + BIN_HEADER_SIZE, value);
+        }
+        return chunk;
+    }
+    if(pid == RUN_QUEUED){
+        return chunk_printf("[SERVER] Run %d queued\r\n", ticket);
+    }
+    if(pid == RUN_FAILED){
+        return chunk_printf("[SERVER] Run %d failed\r\n", ticket);
+    }
+    if(ticket == 0){
+        return chunk_printf("[SERVER] Job %d created\r\n", pid);
+    }
+    return chunk_printf("[SERVER] Job %d created (run %d)\r\n", pid, ticket);
+}
+
+/* Sends the notice built by run_notice to the request's client. The
+ * run queue must be locked, which keeps the client from being freed.
+ */
+void notify_run(RunRequest *request, int pid){
+    Chunk *notice = run_notice(request->client, request->ticket, request->request_id, pid);
+    send_to_client(request->client, notice);
+    if(notice != NULL){
+        chunk_unref(notice);
+    }
+    // Requests are started from whichever thread freed a slot
+    flush_client(request->client);
+}
+
+/* Tells a pending spawn's client that its job started as pid, or failed
+ * when pid is RUN_FAILED, in the reply slot reserved for it unless the run
+ * was queued. A text client is not told when a run it did not queue
+ * fails, as before. The spawns lock must be held, which keeps the client
+ * from being freed.
+ */
+void notify_spawn(PendingSpawn *pending, int pid){
+    Client *client = pending->client;
+    if(client == NULL){
+        if(pending->reply != NULL){
+            chunk_unref(pending->reply);
+        }
+        return;
+    }
+    Chunk *notice = NULL;
+    if(pid != RUN_FAILED || pending->ticket != 0 || client->protocol == PROTO_BINARY){
+        notice = run_notice(client, pending->ticket, pending->request_id, pid);
+    }
+    if(pending->reply != NULL){
+        fill_reply(client, pending->reply, notice);
+    }
+    else{
+        send_to_client(client, notice);
+    }
+    flush_client(client);
+    if(notice != NULL){
+        chunk_unref(notice);
+    }
+}
+
+/* Records a child reaped before its job was added, or forgets one that
+ * failed to exec now that it is reaped. Only called by reactor 0.
+ */
+void note_early_exit(int pid, int status, struct rusage *usage){
+    for(EarlyExit **link = &early_exits; *link != NULL; link = &((*link)->next)){
+        if((*link)->pid == pid && !(*link)->reaped){
+            EarlyExit *expected = *link;
+            *link = expected->next;
+            free(expected);
+            return;
+        }
+    }
+    EarlyExit *early = malloc(sizeof(EarlyExit));
+    if(early == NULL){
+        log_perror("malloc early exit");
+        return;
+    }
+    early->pid = pid;
+    early->reaped = 1;
+    early->status = status;
+    early->usage = *usage;
+    early->next = early_exits;
+    early_exits = early;
+}
+
+/* Removes and returns the record of pid if it has been reaped already.
+ * Otherwise returns NULL, and if expected is set, notes that pid will be
+ * reaped without a job. Only called by reactor 0.
+ */
+EarlyExit *claim_early_exit(int pid, int expected){
+    for(EarlyExit **link = &early_exits; *link != NULL; link = &((*link)->next)){
+        if((*link)->pid == pid && (*link)->reaped){
+            EarlyExit *early = *link;
+            *link = early->next;
+            return early;
+        }
+    }
+    EarlyExit *early = expected ? malloc(sizeof(EarlyExit)) : NULL;
+    if(early != NULL){
+        early->pid = pid;
+        early->reaped = 0;
+        early->next = early_exits;
+        early_exits = early;
+    }
+    return NULL;
+}
+
+/* Adds the job the zygote started for a pending spawn, or releases its job
+ * slot if it could not be started, and tells its client. Jobs are added by
+ * reactor 0, which also reaps them, so no job can be reaped unnoticed.
+ */
+void finish_spawn(JobTable *job_table, ZygoteReply *reply, int fds[ZYGOTE_FDS]){
+    pthread_mutex_lock(&spawns_lock);
+    PendingSpawn **link = &pending_spawns;
+    while(*link != NULL && (*link)->id != reply->id){
+        link = &((*link)->next);
+    }
+    PendingSpawn *pending = *link;
+    JobNode *job_node = NULL;
+    if(pending != NULL && reply->error == 0){
+        *link = pending->next;
+        job_node = new_job(pending->name, reply->pid, fds[ZYGOTE_PIDFD],
+                           fds[ZYGOTE_STDOUT], fds[ZYGOTE_STDERR]);
+    }
+    else if(pending != NULL){
+        *link = pending->next;
+        log_error("server: could not start %s: %s\n", pending->name, strerror(reply->error));
+    }
+    if(job_node == NULL){
+        if(fds[ZYGOTE_PIDFD] != -1){
+            pidfd_send_signal(fds[ZYGOTE_PIDFD], SIGKILL, NULL, 0);
+        }
+        for(int i = 0; i < ZYGOTE_FDS; i++){
+            if(fds[i] != -1){
+                close(fds[i]);
+            }
+        }
+        if(reply->pid > 0){
+            free(claim_early_exit(reply->pid, 1));
+        }
+        if(pending != NULL){
+            release_job_slot(job_table);
+            __atomic_store_n(&slot_freed, 1, __ATOMIC_RELEASE);
+            notify_spawn(pending, RUN_FAILED);
+        }
+        pthread_mutex_unlock(&spawns_lock);
+        free(pending);
+        return;
+    }
+
+    int pid = job_node->pid;
+    event_source_init(&(job_node->stdout_event), EV_JOB_STDOUT, job_node->stdout_fd, job_node);
+    event_source_init(&(job_node->stderr_event), EV_JOB_STDERR, job_node->stderr_fd, job_node);
+    JobList *job_list = lock_job_shard(job_table, pid);
+    add_job(job_list, job_node);
+    EarlyExit *early = claim_early_exit(pid, 0);
+    if(early != NULL){
+        mark_job_dead(job_list, pid, early->status, &(early->usage));
+        free(early);
+    }
+    unlock_job_shard(job_table, pid);
+    // Pipes of a job that has already exited are ready at once, and the job
+    // is finished once they are read to the end
+    reactor_add(reactors[0].epoll_fd, &(job_node->stdout_event), EPOLLIN | EPOLLET);
+    reactor_add(reactors[0].epoll_fd, &(job_node->stderr_event), EPOLLIN | EPOLLET);
+    notify_spawn(pending, pid);
+    pthread_mutex_unlock(&spawns_lock);
+    free(pending);
+}
+
+/* Handles every reply the zygote has sent. If the zygote has gone away,
+ * every job waiting to start fails, as will any later one.
+ */
+void receive_spawns(JobTable *job_table){
+    ZygoteReply reply;
+    int fds[ZYGOTE_FDS];
+    int received;
+    while((received = zygote_receive(zygote_fd, &reply, fds)) == 1){
+        finish_spawn(job_table, &reply, fds);
+    }
+    if(received == 0){
+        return;
+    }
+    log_error("server: lost the zygote, jobs can no longer be started\n");
+    pthread_mutex_lock(&spawns_lock);
+    reactor_remove(reactors[0].epoll_fd, &zygote_event);
+    close(zygote_fd);
+    zygote_fd = -1;
+    unsent_spawns = NULL;
+    unsent_tail = &unsent_spawns;
+    while(pending_spawns != NULL){
+        PendingSpawn *pending = pending_spawns;
+        pending_spawns = pending->next;
+        release_job_slot(job_table);
+        notify_spawn(pending, RUN_FAILED);
+        free(pending->request);
+        free(pending);
+    }
+    __atomic_store_n(&slot_freed, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&spawns_lock);
+}
+
+/* Sends the zygote the requests its socket had no room for, for as long as
+ * it has room. A request that cannot be sent fails as it would have when
+ * first asked for. Only called by reactor 0.
+ */
+void send_unsent_spawns(JobTable *job_table){
+    pthread_mutex_lock(&spawns_lock);
+    while(unsent_spawns != NULL){
+        PendingSpawn *pending = unsent_spawns;
+        int sent = zygote_send(zygote_fd, pending->request, pending->request_len);
+        if(sent == 0){
+            break;
+        }
+        unsent_spawns = pending->unsent_next;
+        if(unsent_spawns == NULL){
+            unsent_tail = &unsent_spawns;
+        }
+        free(pending->request);
+        pending->request = NULL;
+        if(sent == -1){
+            PendingSpawn **link = &pending_spawns;
+            while(*link != pending){
+                link = &((*link)->next);
+            }
+            *link = pending->next;
+            release_job_slot(job_table);
+            __atomic_store_n(&slot_freed, 1, __ATOMIC_RELEASE);
+            notify_spawn(pending, RUN_FAILED);
+            free(pending);
+        }
+    }
+    pthread_mutex_unlock(&spawns_lock);
+}
+
+/* Returns the link to the queued request to start next: the oldest of the
+ * highest priority from the client whose requests started least recently,
+ * so clients with requests of the same priority take turns. The run queue
+ * must be locked and not empty.
+ */
+RunRequest **pick_run(void){
+    RunRequest **best = &(run_queue.first);
+    for(RunRequest **link = &((*best)->next); *link != NULL; link = &((*link)->next)){
+        RunRequest *request = *link;
+        if(request->priority > (*best)->priority ||
+           (request->priority == (*best)->priority &&
+            request->client->run_turn < (*best)->client->run_turn)){
+            best = link;
+        }
+    }
+    return best;
+}
+
+/* Starts queued run requests for as long as there are free job slots.
+ * Their clients are told once the jobs have started, or now if they could
+ * not be.
+ */
+void dispatch_runs(JobTable *job_table){
+    pthread_mutex_lock(&run_queue_lock);
+    while(run_queue.first != NULL){
+        RunRequest **link = pick_run();
+        RunRequest *request = *link;
+        int pid = run_client_job(job_table, request->client, request->args,
+                                 request->ticket, request->request_id);
+        if(pid == RUN_MAXJOBS){
+            break;
+        }
+        *link = request->next;
+        if(*link == NULL){
+            run_queue.tail = link;
+        }
+        run_queue.count--;
+        request->client->queued_runs--;
+        request->client->run_turn = ++run_queue.turns;
+        if(pid == RUN_FAILED){
+            notify_run(request, pid);
+        }
+        free(request);
+    }
+    pthread_mutex_unlock(&run_queue_lock);
+}
+
+/* Adds a run request to the queue, and tells the client it is queued.
+ * command_args are copied. request_id is the id of a binary request.
+ * Returns RUN_QUEUED, RUN_MAXJOBS if the queue or the client's share of
+ * it is full, or RUN_FAILED if the request could not be allocated.
+ */
+int queue_run(JobTable *job_table, Client *client, char **command_args,
+              int priority, uint32_t request_id){
+    int num_args = 0;
+    size_t size = sizeof(RunRequest) + sizeof(char *);
+    for(; command_args[num_args] != NULL; num_args++){
+        size += sizeof(char *) + strlen(command_args[num_args]) + 1;
+    }
+    pthread_mutex_lock(&run_queue_lock);
+    if(run_queue.count >= RUN_QUEUE_MAX || client->queued_runs >= RUN_QUEUE_PER_CLIENT){
+        pthread_mutex_unlock(&run_queue_lock);
+        return RUN_MAXJOBS;
+    }
+    RunRequest *request = malloc(size);
+    if(request == NULL){
+        log_perror("malloc run request");
+        pthread_mutex_unlock(&run_queue_lock);
+        return RUN_FAILED;
+    }
+    request->client = client;
+    request->ticket = ++run_queue.tickets;
+    request->priority = priority < 0 ? 0 : priority >= RUN_PRIORITIES ? RUN_PRIORITIES - 1 : priority;
+    request->request_id = request_id;
+    request->next = NULL;
+    char *strings = (char *)(request->args + num_args + 1);
+    for(int i = 0; i < num_args; i++){
+        request->args[i] = strings;
+        strings = stpcpy(strings, command_args[i]) + 1;
+    }
+    request->args[num_args] = NULL;
+    *(run_queue.tail) = request;
+    run_queue.tail = &(request->next);
+    run_queue.count++;
+    client->queued_runs++;
+    notify_run(request, RUN_QUEUED);
+    pthread_mutex_unlock(&run_queue_lock);
+    // A slot may have been freed since the client was told there was none
+    dispatch_runs(job_table);
+    return RUN_QUEUED;
+}
+
+/* Runs command_args as run_client_job does, or queues the request if every
+ * job slot is taken or other requests are already waiting for one.
+ * Returns RUN_STARTING, RUN_QUEUED, RUN_MAXJOBS or RUN_FAILED. The client
+ * has already been told if RUN_QUEUED is returned, and will be once the
+ * job has started if RUN_STARTING is.
+ */
+int submit_run(JobTable *job_table, Client *client, char **command_args,
+               int priority, uint32_t request_id){
+    pthread_mutex_lock(&run_queue_lock);
+    int waiting = run_queue.count;
+    pthread_mutex_unlock(&run_queue_lock);
+    if(waiting == 0){
+        int pid = run_client_job(job_table, client, command_args, 0, request_id);
+        if(pid != RUN_MAXJOBS){
+            return pid;
+        }
+    }
+    return queue_run(job_table, client, command_args, priority, request_id);
+}
+
+/* Queues the job's output history to the client, in the client's
+ * protocol. The job's shard must be locked, so no live output can come
+ * before it.
+ */
+void replay_history(JobNode *job_node, Client *client){
+    struct job_history *history = &(job_node->history);
+    for(int i = 0; i < history->count; i++){
+        struct history_entry *entry = &(history->entries[(history->head + i) % JOB_HISTORY_LINES]);
+        if(client->protocol != PROTO_BINARY){
+            send_to_client(client, entry->chunk);
+            continue;
+        }
+        // Only the line itself, without the prefix and network newline
+        int line_len = entry->chunk->len - entry->prefix_len - 2;
+        Chunk *binary = bin_chunk_new(entry->is_stderr ? BIN_EV_STDERR : BIN_EV_STDOUT,
+                                      BIN_OK, 0, 4 + line_len);
+        if(binary != NULL){
+            bin_put_u32(binary->data + BIN_HEADER_SIZE, job_node->pid);
+            memcpy(binary->data + BIN_HEADER_SIZE + 4, entry->chunk->data + entry->prefix_len, line_len);
+        }
+        send_to_client(client, binary);
+        if(binary != NULL){
+            chunk_unref(binary);
+        }
+    }
+}
+
+/* Starts the client watching the job with the given pid, or stops it if it
+ * already was watching. When it starts, the started reply and then the
+ * job's recent output are queued to the client ahead of any live output.
+ * Returns WATCH_STARTED, WATCH_STOPPED, WATCH_NOT_FOUND, or -1 on error.
+ */
+int toggle_watch(JobTable *job_table, Client *client, int pid, Chunk *started){
+    JobList *job_list = lock_job_shard(job_table, pid);
+    int result = remove_watcher_by_pid(job_list, pid, client);
+    if(result == 2){
+        result = add_watcher_by_pid(job_list, pid, client) == 0 ? WATCH_STARTED : -1;
+    }
+    if(result == WATCH_STARTED){
+        send_to_client(client, started);
+        replay_history(find_job(job_list, pid), client);
+    }
+    unlock_job_shard(job_table, pid);
+    return result;
+}
+
+/* Starts the client watching the raw stdout of job_node. The job's shard
+ * must be locked.
+ * Returns 0 on success, -1 on error.
+ */
+int add_raw_watcher(JobNode *job_node, Client *client){
+    RawWatcher *raw = pool_alloc(&raw_watcher_pool);
+    if(raw == NULL){
+        return -1;
+    }
+    if(pipe2(raw->pipe, O_NONBLOCK | O_CLOEXEC) == -1){
+        log_perror("pipe2");
+        pool_free(&raw_watcher_pool, raw);
+        return -1;
+    }
+    // A slow watcher may fall this far behind; the kernel may cap it lower
+    fcntl(raw->pipe[PIPE_WRITE], F_SETPIPE_SZ, OUTQ_HIGH_WATER);
+    raw->client = client;
+    raw->job_pid = job_node->pid;
+    raw->detached = 0;
+    raw->job_next = job_node->raw_watchers;
+    job_node->raw_watchers = raw;
+    pthread_mutex_lock(&(client->lock));
+    raw->client_next = client->raw_watchers;
+    client->raw_watchers = raw;
+    pthread_mutex_unlock(&(client->lock));
+    return 0;
+}
+
+/* Starts the client watching the raw stdout of the job with the given
+ * pid, or stops it if it already was.
+ * Returns WATCH_STARTED, WATCH_STOPPED, WATCH_NOT_FOUND, or -1 on error.
+ */
+int toggle_raw_watch(JobTable *job_table, Client *client, int pid){
+    JobList *job_list = lock_job_shard(job_table, pid);
+    JobNode *job_node = find_job(job_list, pid);
+    int result;
+    if(job_node == NULL){
+        result = WATCH_NOT_FOUND;
+    }
+    else if(remove_raw_watcher(job_node, client) == 0){
+        result = WATCH_STOPPED;
+    }
+    else{
+        result = add_raw_watcher(job_node, client) == 0 ? WATCH_STARTED : -1;
+    }
+    unlock_job_shard(job_table, pid);
+    return result;
+}
+
+// Returned by a text command handler for a command whose words are wrong
+#define TEXT_INVALID -1
+
+/* Returns the number in word, or -1 if it is not a whole number from min
+ * to max.
+ */
+long parse_number(const char *word, long min, long max){
+    char *end;
+    errno = 0;
+    long number = strtol(word, &end, 10);
+    if(end == word || *end != '\0' || errno != 0 || number < min || number > max){
+        return -1;
+    }
+    return number;
+}
+
+/* Lists the pids of all jobs, or with -v describes each job and the
+ * resources used by finished ones.
+ * Return their fd if it has been closed, 0 otherwise or TEXT_INVALID.
+ */
+int text_jobs(Client *client, CommandLine *cmd, JobTable *job_table){
+    int verbose = cmd->argc == 1;
+    if(verbose && strcmp(cmd->words[1], "-v") != 0){
+        return TEXT_INVALID;
+    }
+    if((verbose ? send_job_details(client, job_table) : send_job_list(client, job_table)) == -1){
+        return client->socket_fd;
+    }
+    return 0;
+}
+
+/* Runs a job, or queues it, with "run [--priority N] name args...". The
+ * client is told once it has started.
+ * Return their fd if it has been closed, 0 otherwise or TEXT_INVALID.
+ */
+int text_run(Client *client, CommandLine *cmd, JobTable *job_table){
+    char **command_args = cmd->words + 1;
+    int priority = 0;
+    if(strcmp(command_args[0], "--priority") == 0){
+        if(cmd->argc < 3){
+            return TEXT_INVALID;
+        }
+        priority = parse_number(command_args[1], 0, RUN_PRIORITIES - 1);
+        if(priority == -1){
+            return TEXT_INVALID;
+        }
+        command_args += 2;
+    }
+    // "Job N created" is sent once the job has started
+    int pid = submit_run(job_table, client, command_args, priority, 0);
+    if(pid == RUN_MAXJOBS && send_reply(client, "[SERVER] MAXJOBS exceeded\r\n") == -1){
+        return client->socket_fd;
+    }
+    return 0;
+}
+
+/* Kills the job with "kill pid".
+ * Return their fd if it has been closed, 0 otherwise or TEXT_INVALID.
+ */
+int text_kill(Client *client, CommandLine *cmd, JobTable *job_table){
+    int kill_this_pid = parse_number(cmd->words[1], 1, INT_MAX);
+    if(kill_this_pid == -1){
+        return TEXT_INVALID;
+    }
+    int killed_job = kill_job_by_pid(job_table, kill_this_pid);
+    if(killed_job == 1){ // job not found
+        if(send_reply(client, "[SERVER] Job %d not found\r\n", kill_this_pid) == -1){
+            return client->socket_fd;
+        }
+    }
+    else if(killed_job == -1){ // error
+        log_perror("error finding job and killing it with kill_job");
+    }
+    return 0;
+}
+
+/* Toggles watching a job with "watch [--raw] pid".
+ * Return their fd if it has been closed, 0 otherwise or TEXT_INVALID.
+ */
+int text_watch(Client *client, CommandLine *cmd, JobTable *job_table){
+    int raw = cmd->argc == 2;
+    if(raw && strcmp(cmd->words[1], "--raw") != 0){
+        return TEXT_INVALID;
+    }
+    int watch_pid = parse_number(cmd->words[cmd->argc], 1, INT_MAX);
+    if(watch_pid == -1){
+        return TEXT_INVALID;
+    }
+    const char *mode = raw ? " (raw)" : "";
+    int sent = 0;
+    int watching;
+    if(raw){
+        watching = toggle_raw_watch(job_table, client, watch_pid);
+    }
+    else{
+        Chunk *started = chunk_printf("[SERVER] Watching job %d\r\n", watch_pid);
+        watching = toggle_watch(job_table, client, watch_pid, started);
+        if(started != NULL){
+            chunk_unref(started);
+        }
+    }
+    if(watching == WATCH_STOPPED){
+        sent = send_reply(client, "[SERVER] No longer watching job %d%s\r\n", watch_pid, mode);
+    }
+    else if(watching == WATCH_NOT_FOUND){
+        sent = send_reply(client, "[SERVER] Job %d not found\r\n", watch_pid);
+    }
+    else if(watching == WATCH_STARTED && raw){
+        sent = send_reply(client, "[SERVER] Watching job %d%s\r\n", watch_pid, mode);
+    }
+    else if(watching != WATCH_STARTED){
+        log_perror("couldnt add watcher");
+    }
+    return sent == -1 ? client->socket_fd : 0;
+}
+
+/* Reports the server's metrics.
+ * Return their fd if it has been closed or 0 otherwise.
+ */
+int text_stats(Client *client, CommandLine *cmd, JobTable *job_table){
+    Chunk *stats = metrics_chunk(0);
+    int sent = send_to_client(client, stats);
+    if(stats != NULL){
+        chunk_unref(stats);
+    }
+    return sent == -1 ? client->socket_fd : 0;
+}
+
+/* Sets the client's coalescing budgets, with 0 bytes for the server's
+ * default.
+ * Returns 0 on success, or -1 if either is out of range.
+ */
+int set_coalesce(Client *client, long usec, long bytes){
+    if(bytes == 0){
+        bytes = default_coalesce_bytes;
+    }
+    if(usec < 0 || usec > COALESCE_US_MAX || bytes < 0 || bytes > OUTQ_HIGH_WATER){
+        return -1;
+    }
+    __atomic_store_n(&(client->coalesce_us), (int)usec, __ATOMIC_RELAXED);
+    __atomic_store_n(&(client->coalesce_bytes), (int)bytes, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* Sets how long watched output may be held back to be sent together, with
+ * "coalesce usec [bytes]". 0 microseconds sends it at once.
+ * Return their fd if it has been closed, 0 otherwise or TEXT_INVALID.
+ */
+int text_coalesce(Client *client, CommandLine *cmd, JobTable *job_table){
+    long usec = parse_number(cmd->words[1], 0, COALESCE_US_MAX);
+    long bytes = cmd->argc == 2 ? parse_number(cmd->words[2], 0, OUTQ_HIGH_WATER) : 0;
+    if(usec == -1 || bytes == -1 || set_coalesce(client, usec, bytes) == -1){
+        return TEXT_INVALID;
+    }
+    int sent;
+    if(client->coalesce_us == 0){
+        sent = send_reply(client, "[SERVER] Watched output is sent at once\r\n");
+    }
+    else{
+        sent = send_reply(client, "[SERVER] Watched output is held back up to %d us or %d bytes\r\n",
+                          client->coalesce_us, client->coalesce_bytes);
+    }
+    return sent == -1 ? client->socket_fd : 0;
+}
+
+typedef int (*TextHandler)(Client *, CommandLine *, JobTable *);
+
+// Handler of each text command, which parse_command has checked the number
+// of words of. exit is handled by the client, so the server takes it as
+// invalid.
+TextHandler text_handlers[N_JOB_COMMANDS] = {
+    [CMD_LISTJOBS] = text_jobs,
+    [CMD_RUNJOB] = text_run,
+    [CMD_KILLJOB] = text_kill,
+    [CMD_WATCHJOB] = text_watch,
+    [CMD_STATS] = text_stats,
+    [CMD_COALESCE] = text_coalesce,
+};
+
+/* Act on a single message cmd received from the client, without its
+ * network newline. The message is split into words in place, and is
+ * left as it was. The command it names is stored in command, or
+ * CMD_INVALID if it is not a valid command, so only valid ones are
+ * counted under their name.
+ * Return their fd if it has been closed or 0 otherwise.
+ */
+int process_client_command(Client *client, char *cmd, JobTable *job_table, JobCommand *command){
+    *command = CMD_INVALID;
+    if(client->socket_fd == -1){
+        return 0;
+    }
+    // Only as many words as the line has, as a run may have thousands
+    char *words[count_words(cmd) + 1];
+    CommandLine line;
+    int parsed = parse_command(cmd, &line, words);
+    *command = line.command;
+    int result = TEXT_INVALID;
+    if(parsed == 0){
+        result = 0;
+    }
+    else if(parsed == 1 && text_handlers[line.command] != NULL){
+        result = text_handlers[line.command](client, &line, job_table);
+    }
+    restore_command(&line);
+    if(result == TEXT_INVALID){
+        *command = CMD_INVALID;
+        // The old server ran this line into the one logging the command
+        log_info("[SERVER] Invalid command: %s%s", cmd, compat_logging ? "" : "\n");
+        return 0;
+    }
+    return result;
+}
+
+/* Allocates a binary reply to request carrying the given 32 bit fields
+ * as its payload.
+ * Returns NULL if it could not be allocated.
+ */
+Chunk *vbin_reply_chunk(BinHeader *request, int status, int num_fields, va_list args){
+    Chunk *chunk = bin_chunk_new(request->opcode, status, request->request_id, num_fields * 4);
+    if(chunk != NULL){
+        for(int i = 0; i < num_fields; i++){
+            bin_put_u32(chunk->data + BIN_HEADER_SIZE + i * 4, va_arg(args, int));
+        }
+    }
+    return chunk;
+}
+
+Chunk *bin_reply_chunk(BinHeader *request, int status, int num_fields, ...){
+    va_list args;
+    va_start(args, num_fields);
+    Chunk *chunk = vbin_reply_chunk(request, status, num_fields, args);
+    va_end(args);
+    return chunk;
+}
+
+/* Sends a binary reply carrying the given 32 bit fields as its payload.
+ * Returns 0 on success, or -1 if the client is being closed.
+ */
+int send_bin_reply(Client *client, BinHeader *request, int status, int num_fields, ...){
+    va_list args;
+    va_start(args, num_fields);
+    Chunk *chunk = vbin_reply_chunk(request, status, num_fields, args);
+    va_end(args);
+    int result = send_to_client(client, chunk);
+    if(chunk != NULL){
+        chunk_unref(chunk);
+    }
+    return result;
+}
+
+/* Act on a single binary request from the client. Every request is
+ * answered, including kill, since replies are matched by request id.
+ * Return their fd if it has been closed or 0 otherwise.
+ */
+int process_binary_command(Client *client, BinHeader *header, char *payload, JobTable *job_table){
+    int fd = client->socket_fd;
+    int sent = 0;
+    if(header->opcode == CMD_LISTJOBS){
+        log_debug("[CLIENT %d] jobs\n", fd);
+        int *pids;
+        int count = collect_job_pids(job_table, &pids);
+        if(count == -1){
+            return send_bin_reply(client, header, BIN_FAILED, 0) == -1 ? fd : 0;
+        }
+        Chunk *chunk = bin_chunk_new(header->opcode, BIN_OK, header->request_id, count * 4);
+        if(chunk != NULL){
+            for(int i = 0; i < count; i++){
+                bin_put_u32(chunk->data + BIN_HEADER_SIZE + i * 4, pids[i]);
+            }
+        }
+        free(pids);
+        sent = send_to_client(client, chunk);
+        if(chunk != NULL){
+            chunk_unref(chunk);
+        }
+    }
+    else if(header->opcode == CMD_RUNJOB){
+        // The job name and arguments are null-terminated strings
+        char *command_args[BIN_PAYLOAD_MAX + 1];
+        int arg_counter = 0;
+        int valid = header->length > 0 && payload[header->length - 1] == '\0';
+        for(int i = 0; valid && i < header->length; i += strlen(payload + i) + 1){
+            command_args[arg_counter++] = payload + i;
+        }
+        command_args[arg_counter] = NULL;
+        log_debug("[CLIENT %d] run %s\n", fd, valid ? payload : "");
+
+        // The status of a request is its priority
+        int pid = valid ? submit_run(job_table, client, command_args, header->status,
+                                     header->request_id) : RUN_FAILED;
+        if(!valid){
+            sent = send_bin_reply(client, header, BIN_INVALID, 0);
+        }
+        else if(pid == RUN_MAXJOBS){
+            sent = send_bin_reply(client, header, BIN_MAXJOBS, 0);
+        }
+        else if(pid == RUN_FAILED){
+            sent = send_bin_reply(client, header, BIN_FAILED, 0);
+        }
+    }
+    else if((header->opcode == CMD_KILLJOB || header->opcode == CMD_WATCHJOB) &&
+            header->length == 4){
+        int pid = bin_get_u32(payload);
+        if(header->opcode == CMD_KILLJOB){
+            log_debug("[CLIENT %d] kill %d\n", fd, pid);
+            int killed_job = kill_job_by_pid(job_table, pid);
+            sent = send_bin_reply(client, header, killed_job == 0 ? BIN_OK :
+                                  killed_job == 1 ? BIN_NOT_FOUND : BIN_FAILED, 1, pid);
+        }
+        else{
+            log_debug("[CLIENT %d] watch %d\n", fd, pid);
+            Chunk *started = bin_reply_chunk(header, BIN_OK, 2, pid, 1);
+            int watching = toggle_watch(job_table, client, pid, started);
+            if(started != NULL){
+                chunk_unref(started);
+            }
+            if(watching == WATCH_NOT_FOUND){
+                sent = send_bin_reply(client, header, BIN_NOT_FOUND, 1, pid);
+            }
+            else if(watching == -1){
+                sent = send_bin_reply(client, header, BIN_FAILED, 1, pid);
+            }
+            else if(watching == WATCH_STOPPED){
+                sent = send_bin_reply(client, header, BIN_OK, 2, pid, 0);
+            }
+        }
+    }
+    else if(header->opcode == CMD_STATS){
+        log_debug("[CLIENT %d] stats\n", fd);
+        Chunk *stats = metrics_chunk(1);
+        if(stats == NULL){
+            return send_bin_reply(client, header, BIN_FAILED, 0) == -1 ? fd : 0;
+        }
+        Chunk *chunk = bin_chunk_new(header->opcode, BIN_OK, header->request_id, stats->len);
+        if(chunk != NULL){
+            memcpy(chunk->data + BIN_HEADER_SIZE, stats->data, stats->len);
+        }
+        chunk_unref(stats);
+        sent = send_to_client(client, chunk);
+        if(chunk != NULL){
+            chunk_unref(chunk);
+        }
+    }
+    else if(header->opcode == CMD_COALESCE && header->length == 8){
+        long usec = bin_get_u32(payload);
+        long bytes = bin_get_u32(payload + 4);
+        log_debug("[CLIENT %d] coalesce %ld %ld\n", fd, usec, bytes);
+        if(set_coalesce(client, usec, bytes) == -1){
+            sent = send_bin_reply(client, header, BIN_INVALID, 0);
+        }
+        else{
+            sent = send_bin_reply(client, header, BIN_OK, 2, client->coalesce_us,
+                                  client->coalesce_bytes);
+        }
+    }
+    else{
+        log_info("[SERVER] Invalid binary command: %d\n", header->opcode);
+        sent = send_bin_reply(client, header, BIN_INVALID, 0);
+    }
+    return sent == -1 ? fd : 0;
+}
+
+/* Works out which protocol the client speaks from the first bytes it
+ * sent, and consumes the binary magic.
+ * Returns 0 once the protocol is known, 1 if more bytes are needed, or -1
+ * if the client is being closed.
+ */
+int negotiate_protocol(Client *client){
+    Buffer *buffer = &(client->buffer);
+    int available = buffer->inbuf - buffer->consumed;
+    int compare = available < BIN_MAGIC_LEN ? available : BIN_MAGIC_LEN;
+    if(memcmp(buffer->buf + buffer->consumed, BIN_MAGIC, compare) != 0){
+        client->protocol = PROTO_TEXT;
+        return 0;
+    }
+    if(compare < BIN_MAGIC_LEN){
+        return 1;
+    }
+    skip_buffer(buffer, BIN_MAGIC_LEN);
+    client->protocol = PROTO_BINARY;
+    Chunk *magic = chunk_new(BIN_MAGIC_LEN);
+    if(magic != NULL){
+        memcpy(magic->data, BIN_MAGIC, BIN_MAGIC_LEN);
+        magic->len = BIN_MAGIC_LEN;
+    }
+    int result = send_to_client(client, magic);
+    if(magic != NULL){
+        chunk_unref(magic);
+    }
+    return result;
+}
+
+/* Handles every complete binary request in the client's buffer.
+ * Return their fd if it has been closed or 0 otherwise.
+ */
+int process_binary_requests(Client *client, JobTable *job_table){
+    BinHeader header;
+    char *payload;
+    int found = 0;
+    while((found = get_next_frame(&(client->buffer), &header, &payload)) == 1){
+        long start = metrics_now();
+        int closed = process_binary_command(client, &header, payload, job_table);
+        metrics_command(&(client->reactor->metrics), header.opcode, start);
+        if(closed > 0){
+            return client->socket_fd;
+        }
+    }
+    if(found == -1){
+        // There is no way to find the next request after one this long
+        send_bin_reply(client, &header, BIN_INVALID, 0);
+        return client->socket_fd;
+    }
+    return 0;
+}
+
+/* Handles the complete commands in the client's buffer, in whichever
+ * protocol it speaks.
+ * Return their fd if it has been closed or 0 otherwise.
+ */
+int process_buffered_commands(Client *client, JobTable *job_table){
+    int fd = client->socket_fd;
+    Buffer *buffer = &(client->buffer);
+    if(client->protocol == PROTO_UNKNOWN){
+        if(buffer->inbuf == buffer->consumed){
+            return 0;
+        }
+        int negotiated = negotiate_protocol(client);
+        if(negotiated == -1){
+            return fd;
+        }
+        if(negotiated == 1){
+            return 0;
+        }
+    }
+    if(client->protocol == PROTO_BINARY){
+        return process_binary_requests(client, job_table) > 0 ? fd : 0;
+    }
+    char *msg;
+    int msg_len;
+    while((msg = get_next_msg(buffer, &msg_len, NEWLINE_CRLF)) != NULL){
+        long start = metrics_now();
+        JobCommand command;
+        int closed = process_client_command(client, msg, job_table, &command);
+        metrics_command(&(client->reactor->metrics), command, start);
+        if(closed > 0){
+            return fd;
+        }
+        // Logging client msgs
+        char *client_msg = "[CLIENT %d] %s\n";
+        log_debug(client_msg, fd, msg);
+    }
+    return 0;
+}
 
-#ifndef JOBS_DIR
-    #define JOBS_DIR "jobs/"
-#endif
+/* Read and process commands from the client, in whichever protocol it
+ * speaks. The socket is read until it would block and every complete
+ * command is handled in order; the replies are only queued, a run's in a
+ * slot reserved until its job has started.
+ * Return their fd if it has been closed or 0 otherwise.
+ */
+int process_client_request(Client *client, JobTable *job_table){
+    int fd = client->socket_fd;
+    while(1){
+        if(process_buffered_commands(client, job_table) > 0){
+            return fd;
+        }
+        int num_read = read_to_buf(fd, &(client->buffer)); // Read to clients buffer
+        if(num_read == 0){
+            return fd;
+        }
+        else if(num_read == -1){
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                trim_buffer(&(client->buffer));
+                return 0;
+            }
+            if(errno != ENOBUFS){
+                log_perror("Reading Error\n");
+                return fd;
+            }
+            // The command is too long; the rest of it is ignored as it arrives
+            if(send_reply(client, "*(SERVER)* Command longer than %d bytes ignored\r\n", BUF_MAX) == -1){
+                return fd;
+            }
+            discard_line(&(client->buffer));
+        }
+    }
+}
 
-// Global list of jobs
-JobList job_list;
+/* Queues a message to every watcher of job_node, text as a text chunk and
+ * binary as a binary one, either of which may be NULL if no watcher speaks
+ * that protocol. The same chunk is shared by all watchers; nothing is
+ * copied per watcher. Watchers over OUTQ_HIGH_WATER are handled according
+ * to SLOW_CLIENT_POLICY. The job's shard must be locked.
+ */
+void announce_to_watchers(JobNode *job_node, Chunk *text, Chunk *binary){
+    WatcherNode *watcher = job_node->watcher_list.first;
+    while(watcher != NULL){
+        Client *client = watcher->client;
+        Chunk *chunk = client->protocol == PROTO_BINARY ? binary : text;
+        pthread_mutex_lock(&(client->lock));
+        int failed = 0;
+        if(client->closing){
+            // nothing more is sent to it
+        }
+        else if(chunk == NULL){
+            failed = 1;
+        }
+        else if(client->outq.bytes + chunk->len > OUTQ_HIGH_WATER){
+            failed = SLOW_CLIENT_POLICY == SLOW_CLIENT_DISCONNECT;
+        }
+        else if(outq_push(&(client->outq), chunk) == -1){
+            failed = 1;
+        }
+        pthread_mutex_unlock(&(client->lock));
+        if(failed){
+            mark_client_closing(client);
+        }
+        watcher = watcher->next;
+    }
+}
 
-// Flag to keep track of SIGINT received
-int sigint_received;
+/* Returns 1 if any watcher of job_node speaks the binary protocol. The
+ * job's shard must be locked.
+ */
+int has_binary_watchers(JobNode *job_node){
+    for(WatcherNode *watcher = job_node->watcher_list.first; watcher != NULL; watcher = watcher->next){
+        if(watcher->client->protocol == PROTO_BINARY){
+            return 1;
+        }
+    }
+    return 0;
+}
 
-/* SIGINT handler:
- * We are just raising the sigint_received flag here. Our program will
- * periodically check to see if this flag has been raised, and any necessary
- * work will be done in main() and/or the helper functions. Write your signal
- * handlers with care, to avoid issues with async-signal-safety.
+/* Allocates a binary event for job_node carrying its pid and the given 32
+ * bit fields, if any of its watchers speaks the binary protocol.
+ * Returns NULL if none does or on error.
  */
-void sigint_handler(int code) {
-    sigint_received = 1;
+Chunk *job_event_chunk(JobNode *job_node, int event, int num_fields, ...){
+    if(!has_binary_watchers(job_node)){
+        return NULL;
+    }
+    Chunk *chunk = bin_chunk_new(event, BIN_OK, 0, 4 + num_fields * 4);
+    if(chunk == NULL){
+        return NULL;
+    }
+    bin_put_u32(chunk->data + BIN_HEADER_SIZE, job_node->pid);
+    va_list args;
+    va_start(args, num_fields);
+    for(int i = 0; i < num_fields; i++){
+        bin_put_u32(chunk->data + BIN_HEADER_SIZE + 4 + i * 4, va_arg(args, int));
+    }
+    va_end(args);
+    return chunk;
 }
 
-// TODO: SIGCHLD (child stopped or terminated) handler: mark jobs as dead
-void sigchld_handler(int code);
+/* Sets the flush timer to go off at deadline, from metrics_now, or
+ * disarms it if deadline is 0. The coalesce lock must be held.
+ */
+void arm_flush_timer(long deadline){
+    struct itimerspec when = {{0, 0}, {deadline / 1000000000L, deadline % 1000000000L}};
+    if(timerfd_settime(flush_timer_fd, TFD_TIMER_ABSTIME, &when, NULL) == -1){
+        log_perror("timerfd_settime");
+    }
+    flush_timer_deadline = deadline;
+}
 
-/* Return the highest fd between all clients and job pipes.
+/* Holds back the client's queued output until deadline, unless it is
+ * already held back until earlier. The coalesce lock must be held.
  */
-int get_highest_fd(int listen_fd, Client *clients, JobList *job_list){
-    int max_fd = listen_fd;
-    for(int i = 0; i < MAX_CLIENTS; i++){
-        if(clients[i].socket_fd > max_fd){
-            max_fd = clients[i].socket_fd;
-        }
+void schedule_flush(Client *client, long deadline){
+    if(client->flush_deadline != 0){
+        return;
     }
-    struct job_node *current;
-    current = job_list->first;
-    while(current != NULL){
-        if(current->stdout_fd > max_fd){
-	    max_fd = current->stdout_fd;
-	}
-	if(current->stderr_fd > max_fd){
-	    max_fd = current->stderr_fd;
-	}
-        current = current->next;
+    client->flush_deadline = deadline;
+    client->coalesce_next = coalescing;
+    client->coalesce_link = &coalescing;
+    if(coalescing != NULL){
+        coalescing->coalesce_link = &(client->coalesce_next);
+    }
+    coalescing = client;
+    if(flush_timer_deadline == 0 || deadline < flush_timer_deadline){
+        arm_flush_timer(deadline);
     }
-    return max_fd;
-
 }
 
-/*
- *  Client management
+/* Collects the watchers of job_node whose queued output is to be written
+ * now, each with a reference, for flush_collected once the shard is
+ * unlocked. With coalesce, a watcher with a latency budget has its output
+ * held back instead, until the budget runs out or its byte budget is
+ * queued. A watcher collected early no longer waits for the timer. The
+ * job's shard must be locked.
+ * Returns the first client collected, or NULL if there is none.
  */
+Client *collect_watchers(JobNode *job_node, int coalesce){
+    long now = coalesce ? metrics_now() : 0;
+    Client *collected = NULL;
+    pthread_mutex_lock(&coalesce_lock);
+    for(WatcherNode *watcher = job_node->watcher_list.first; watcher != NULL;
+        watcher = watcher->next){
+        Client *client = watcher->client;
+        int budget = __atomic_load_n(&(client->coalesce_us), __ATOMIC_RELAXED);
+        if(coalesce && budget > 0){
+            pthread_mutex_lock(&(client->lock));
+            int hold = client->outq.bytes <
+                       (size_t)__atomic_load_n(&(client->coalesce_bytes), __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&(client->lock));
+            if(hold){
+                schedule_flush(client, now + budget * 1000L);
+                continue;
+            }
+        }
+        unlink_coalescing(client);
+        client_ref(client);
+        client->flush_next = collected;
+        collected = client;
+    }
+    pthread_mutex_unlock(&coalesce_lock);
+    return collected;
+}
 
-/* Accept a connection and adds them to list of clients.
- * Return the new client's file descriptor or -1 on error.
+/* Writes out the queued output of the clients collected by
+ * collect_watchers or flush_due_watchers, one sendmsg per client for
+ * everything announced since its last flush, and drops their references.
+ * Called with no lock held, so no job or timer waits on their sockets.
+ * Whatever does not fit is written when the socket becomes writable.
  */
-int setup_new_client(int listen_fd, Client *clients){
+void flush_collected(Client *collected){
+    while(collected != NULL){
+        Client *client = collected;
+        collected = client->flush_next;
+        flush_client(client);
+        client_unref(client);
+    }
+}
 
-    int user_index = 0;
-    while (user_index < MAX_CLIENTS && clients[user_index].socket_fd != -1) {
-        user_index++;
+/* Writes out the held back output of every client whose latency budget
+ * has run out, and sets the flush timer for the next one due. Run on
+ * reactor 0 when the timer goes off.
+ */
+void flush_due_watchers(void){
+    uint64_t expirations;
+    if(read(flush_timer_fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN){
+        log_perror("read timerfd");
+    }
+    long now = metrics_now();
+    long next = 0;
+    Client *collected = NULL;
+    pthread_mutex_lock(&coalesce_lock);
+    Client *client = coalescing;
+    while(client != NULL){
+        Client *following = client->coalesce_next;
+        if(client->flush_deadline <= now){
+            // A client on the list is not freed before it is unlinked
+            unlink_coalescing(client);
+            client_ref(client);
+            client->flush_next = collected;
+            collected = client;
+        }
+        else if(next == 0 || client->flush_deadline < next){
+            next = client->flush_deadline;
+        }
+        client = following;
     }
+    arm_flush_timer(next);
+    pthread_mutex_unlock(&coalesce_lock);
+    flush_collected(collected);
+}
 
-    int client_fd = accept_connection(listen_fd);
-    if (client_fd < 0) {
+/* Duplicates the bytes waiting in the job's stdout pipe fd into the pipe
+ * of every raw watcher with tee(), without consuming them, and moves what
+ * each watcher's socket accepts on to it. Watchers whose pipe cannot take
+ * all of it are handled according to SLOW_CLIENT_POLICY. The job's shard
+ * must be locked.
+ * Returns the number of bytes duplicated, which the caller must then read
+ * from fd, 0 if the job closed its end, or -1 if nothing is waiting.
+ */
+int tee_to_raw_watchers(JobNode *job_node, int fd){
+    int available = 0;
+    while(ioctl(fd, FIONREAD, &available) == 0 && available == 0){
+        // Only once the writer is gone is nothing waiting the end, as more
+        // could arrive between the ioctl and a read.
+        struct pollfd ready = {fd, POLLIN, 0};
+        if(poll(&ready, 1, 0) <= 0 || (ready.revents & POLLIN) == 0){
+            return ready.revents & POLLHUP ? 0 : -1;
+        }
+    }
+    if(available <= 0){
         return -1;
     }
+    for(RawWatcher *raw = job_node->raw_watchers; raw != NULL; raw = raw->job_next){
+        Client *client = raw->client;
+        ssize_t teed = tee(fd, raw->pipe[PIPE_WRITE], available, SPLICE_F_NONBLOCK);
+        int failed = teed < available && SLOW_CLIENT_POLICY == SLOW_CLIENT_DISCONNECT;
+        pthread_mutex_lock(&(client->lock));
+        if(!client->closing && client->outq.count == 0 && drain_raw_watchers(client) == -1){
+            failed = 1;
+        }
+        pthread_mutex_unlock(&(client->lock));
+        if(failed){
+            mark_client_closing(client);
+        }
+    }
+    return available;
+}
 
-    if (user_index >= MAX_CLIENTS) {
-        fprintf(stderr, "server: max concurrent connections\n");
-        close(client_fd);
-        return -1;
+/* Unlinks every raw watcher from job_node as it finishes. Each stays with
+ * its client until the client has been sent all of it. The job's shard
+ * must be locked.
+ */
+void detach_raw_watchers(JobNode *job_node){
+    RawWatcher *raw = job_node->raw_watchers;
+    job_node->raw_watchers = NULL;
+    while(raw != NULL){
+        RawWatcher *next = raw->job_next;
+        Client *client = raw->client;
+        pthread_mutex_lock(&(client->lock));
+        raw->detached = 1;
+        int failed = !client->closing && client->outq.count == 0 &&
+                     drain_raw_watchers(client) == -1;
+        pthread_mutex_unlock(&(client->lock));
+        if(failed){
+            mark_client_closing(client);
+        }
+        raw = next;
     }
+}
 
-    clients[user_index].socket_fd = client_fd;
-    return client_fd;
+/* Formats one line of job output from the given stream, with the prefix
+ * "[JOB %d] " for stdout or "*(JOB %d)* " for stderr, logs it and
+ * announces it to the job's watchers. The job's shard must be locked.
+ */
+void announce_job_line(JobNode *job_node, EventType stream, const char *msg, int msg_len){
+    const char *prefix = stream == EV_JOB_STDOUT ? "[JOB %d] " : "*(JOB %d)* ";
+    Chunk *chunk = chunk_new(JOB_PREFIX_MAX + msg_len + 2);
+    if(chunk == NULL){
+        return;
+    }
+    int len = snprintf(chunk->data, JOB_PREFIX_MAX, prefix, job_node->pid);
+    memcpy(chunk->data + len, msg, msg_len);
+    len += msg_len;
+    chunk->data[len++] = '\r';
+    chunk->data[len++] = '\n';
+    chunk->len = len;
+    log_debug("%.*s\n", len - 2, chunk->data);
+    history_push(job_node, chunk, stream == EV_JOB_STDERR, len - msg_len - 2);
+
+    Chunk *binary = NULL;
+    if(has_binary_watchers(job_node)){
+        binary = bin_chunk_new(stream == EV_JOB_STDOUT ? BIN_EV_STDOUT : BIN_EV_STDERR,
+                               BIN_OK, 0, 4 + msg_len);
+        if(binary != NULL){
+            bin_put_u32(binary->data + BIN_HEADER_SIZE, job_node->pid);
+            memcpy(binary->data + BIN_HEADER_SIZE + 4, msg, msg_len);
+        }
+    }
+    announce_to_watchers(job_node, chunk, binary);
+    chunk_unref(chunk);
+    if(binary != NULL){
+        chunk_unref(binary);
+    }
 }
 
-/* Closes a client and removes it from the list of clients.
- * Return the highest fd between all clients.
+/* Read characters from fd and store them in buffer. Announce each message found
+ * to watchers of job_node as output of the stream source is for. Raw
+ * watchers of stdout are sent each byte before it is read.
+ * The pipe is edge-triggered, so it is read until it would block. Once the
+ * job closes its end, any unterminated last line is announced and the fd is
+ * closed and set to -1 in source. Only reactor 0, which owns buffer, reads
+ * it, so the job's shard is only locked to tee and to announce each read.
  */
-int remove_client(int listen_fd, int client_index, Client *clients, JobList *job_list){
-	if(clients[client_index].socket_fd != -1){
-	    clients[client_index].socket_fd = -1;
-	    clients[client_index].buffer.buf[0] = '\0';
-	    clients[client_index].buffer.inbuf = 0;
-	}
-	return get_highest_fd(listen_fd, clients, job_list);
+void process_job_output(JobTable *job_table, JobNode *job_node, EventSource *source, Buffer *buffer){
+    int pid = job_node->pid;
+    int raw_pending = 0;    // bytes sent to raw watchers and not read yet
+    lock_job_shard(job_table, pid);
+    while(1){
+        if(raw_pending == 0 && source->type == EV_JOB_STDOUT && job_node->raw_watchers != NULL){
+            raw_pending = tee_to_raw_watchers(job_node, source->fd);
+            if(raw_pending == -1){
+                break;
+            }
+        }
+        // A job writing a lot must not hold up the others in its shard
+        unlock_job_shard(job_table, pid);
+        // Nothing may be read that raw watchers have not been sent
+        int num_read = read_to_buf_max(source->fd, buffer, raw_pending > 0 ? raw_pending : BUF_MAX);
+        int read_errno = errno;
+        lock_job_shard(job_table, pid);
+        if(num_read > 0 && raw_pending > 0){
+            raw_pending -= num_read;
+        }
+        if(num_read == -1){
+            if(read_errno == ENOBUFS){
+                Chunk *full = chunk_printf("*(SERVER)* Buffer from job %d is full. Aborting job.\r\n",
+                                           job_node->pid);
+                if(full != NULL){
+                    log_info("%.*s\n", full->len - 2, full->data);
+                    Chunk *binary = job_event_chunk(job_node, BIN_EV_BUFFER_FULL, 0);
+                    announce_to_watchers(job_node, full, binary);
+                    chunk_unref(full);
+                    if(binary != NULL){
+                        chunk_unref(binary);
+                    }
+                }
+                kill_job_node(job_node);
+                discard_line(buffer);
+                continue;
+            }
+            if(read_errno != EAGAIN && read_errno != EWOULDBLOCK){
+                errno = read_errno;
+                log_perror("Error reading from process_job_output");
+            }
+            break;
+        }
+        else if(num_read == 0){
+            if(buffer->inbuf > buffer->consumed){
+                shift_buffer(buffer);
+                announce_job_line(job_node, source->type, buffer->buf, buffer->inbuf);
+                reset_buffer(buffer);
+            }
+            close(source->fd);
+            if(source->fd == job_node->stdout_fd){
+                job_node->stdout_fd = -1;
+            }
+            else{
+                job_node->stderr_fd = -1;
+            }
+            source->fd = -1;
+            break;
+        }
+        metric_add(&(current_reactor->metrics.counters[source->type == EV_JOB_STDOUT ?
+                                                       MET_STDOUT_BYTES : MET_STDERR_BYTES]), num_read);
+        log_debug("BUFFER IN PROCESS JOB OUTPUT IS: %.*s\n", num_read,
+               buffer->buf + buffer->inbuf - num_read);
+        char *msg;
+        int msg_len;
+        while((msg = get_next_msg(buffer, &msg_len, NEWLINE_LF)) != NULL){
+            announce_job_line(job_node, source->type, msg, msg_len);
+        }
+    }
+    trim_buffer(buffer);
+    Client *flush = collect_watchers(job_node, 1);
+    unlock_job_shard(job_table, pid);
+    flush_collected(flush);
 }
 
-/* Read message from client and act accordingly.
- * Return their fd if it has been closed or 0 otherwise.
+/* Announces how the job exited to its watchers and removes it. Only
+ * called once the job is dead and both of its pipes are closed, so the
+ * notice comes after all of its output and no event refers to it.
  */
-int process_client_request(Client *client, JobList *job_list, fd_set *all_fds){
-    if(client->socket_fd != -1){
-	int fd = client->socket_fd;
-	int num_read = read_to_buf(fd ,&(client->buffer)); // Read to clients buffer
-	if(num_read == 0){
-	    return fd;
-	}
-	else if(num_read == -1){
-	    perror("Reading Error\n");
-	    return fd;
-	}
+void finish_job(JobTable *job_table, JobNode *job_node){
+    int pid = job_node->pid;
+    JobList *job_list = lock_job_shard(job_table, pid);
+    Client *flush = NULL;
+    struct rusage *used = &(job_node->usage);
+    char usage[160];
+    describe_usage(usage, sizeof(usage), seconds(used->ru_utime), seconds(used->ru_stime),
+                   used->ru_maxrss, used->ru_nvcsw, used->ru_nivcsw);
+    account_job(job_node);
+    Chunk *notice;
+    if(WIFEXITED(job_node->wait_status)){
+        notice = chunk_printf("[JOB %d] Exited with status %d (%s)\r\n",
+                              pid, WEXITSTATUS(job_node->wait_status), usage);
+    }
+    else{
+        notice = chunk_printf("[JOB %d] Exited due to signal. (%s)\r\n", pid, usage);
+    }
+    if(notice != NULL){
+        log_info("%.*s\n", notice->len - 2, notice->data);
+        Chunk *binary = job_event_chunk(job_node, BIN_EV_EXITED, 6, job_node->wait_status,
+                                        (int)(seconds(used->ru_utime) * 1000),
+                                        (int)(seconds(used->ru_stime) * 1000),
+                                        (int)used->ru_maxrss, (int)used->ru_nvcsw,
+                                        (int)used->ru_nivcsw);
+        announce_to_watchers(job_node, notice, binary);
+        // Nothing more comes from the job to hold its last output back for
+        flush = collect_watchers(job_node, 0);
+        chunk_unref(notice);
+        if(binary != NULL){
+            chunk_unref(binary);
+        }
+    }
+    detach_raw_watchers(job_node);
+    remove_job(job_list, pid);
+    unlock_job_shard(job_table, pid);
+    flush_collected(flush);
+    release_job_slot(job_table);
+    // Queued runs are started at the end of the batch of events
+    __atomic_store_n(&slot_freed, 1, __ATOMIC_RELEASE);
+}
 
-	// checks if the command is too long
-	int where = find_network_newline(client->buffer.buf, client->buffer.inbuf);
-	if(where == -1 && client->buffer.inbuf > BUFSIZE){  // TODO or is it >= BUFSIZE
-	    char *too_long = "*(SERVER)* Buffer from job %d is full. Aborting job.\r\n";
-	    char inv[BUFSIZE + 2];
-	    strcpy(inv, too_long);
-	    if(write(client->socket_fd, inv, strlen(inv)) == -1){
-		perror("write invalid command length failed\n");
-		return fd;
-	    }
-	}
-        if(where != -1){ // find_network_newline passed which means command is 1 str with \r\n
-            client->buffer.buf[where-2] = '\0';
-        }
-
-	// Parsing the command to check if its legal
-	char str[BUFSIZE];
-	strcpy(str, client->buffer.buf);
-	int ll = strlen(str);
-        char *token = strtok(str, " ");
-	int where2 = find_network_newline(token, strlen(token));
-        if(where2 != -1){ // find_network_newline passed which means command is 1 str with \r\n
-	    token[where2-2] = '\0';
-	}
-        if(strcmp(token, "jobs") != 0 && strcmp(token, "run") != 0 && strcmp(token, "watch") != 0 && strcmp(token, "kill") != 0){
-            printf("[SERVER] Invalid command: %s", client->buffer.buf);
-        }
-	if(strcmp(token, "jobs") == 0){ // print list of jobs and return 0
-	    if(job_list->count == 0){
-		char *zero_jobs = "[SERVER] No currently running jobs\r\n";
-		if(write(client->socket_fd, zero_jobs, strlen(zero_jobs)) == -1){
-		    perror("couldnt write no running jobs to client");
-		    return fd;
-		}
-	    }
-	    else{
-	        char msg[BUFSIZE+2];
-	        struct job_node *current;
-    	        current = job_list->first;
-	        char process_id[BUFSIZE];
-		strcpy(msg, "[SERVER]");
-    	        while(current != NULL){
-		    strcat(msg, " ");
-		    sprintf(process_id, "%d", current->pid);
-		    strcat(msg, process_id);
-                    current = current->next;
-    	        }
-	        strcat(msg, "\r\n");
-	        if(write(client->socket_fd, msg, strlen(msg)) == -1){
-                    perror("couldnt write the running jobs pid to client");
-		    return fd;
-                }
-		int l = strlen(msg);
-                for(int i = 0; i < l; i++){
-                    process_id[i] = '\0';
-                    msg[i] = '\0';
-                }
-	    }
-	}
-	else if(strcmp(token, "run") == 0){ // runs jobcommand
-	    if(job_list->count < MAX_JOBS){
-	        token = strtok(NULL, " "); // gets jobname
-		char exe_file[BUFSIZE];
-		//printf("%d\n", snprintf(exe_file, BUFSIZE, "%s%s", JOBS_DIR, token));
-		if(snprintf(exe_file, BUFSIZE, "%s%s", JOBS_DIR, token) < 0){
-			perror("Job doesnt exist");
-			return fd;
-		}
-		struct stat statbuff;
-    		if (lstat(exe_file, &statbuff) == -1){
-
-        		return 0;
-    		}
-		char *command_args[BUFSIZE];
-		int arg_counter = 0;
-		token = strtok(NULL, " ");
-	        while(token != NULL){ // While there are tokens (args) in string
-		    int where4 = find_network_newline(token, strlen(token));
-        	    if(where4 != -1){ // fixes the last arg
-            	        token[where4-2] = '\0';
-        	    }
-		    command_args[arg_counter] = token;
-		    token = strtok(NULL, " ");
-                }
+/* Reaps every child that has exited since the last SIGCHLD, marking its
+ * job dead. Signals are merged while pending, so one wakeup may stand for
+ * many children and waitpid is called until none are left.
+ */
+void reap_children(int signal_fd, JobTable *job_table){
+    struct signalfd_siginfo info;
+    while(read(signal_fd, &info, sizeof(info)) == sizeof(info)){
+        // only the wakeup matters, the children are found by waitpid
+    }
+    int status;
+    struct rusage usage;
+    pid_t pid;
+    while((pid = wait4(-1, &status, WNOHANG, &usage)) > 0){
+        if(pid == zygote_pid){
+            log_warn("server: zygote exited\n");
+            zygote_pid = -1;
+            continue;
+        }
+        JobList *job_list = lock_job_shard(job_table, pid);
+        JobNode *job_node = find_job(job_list, pid);
+        if(job_node != NULL){
+            mark_job_dead(job_list, pid, status, &usage);
+        }
+        unlock_job_shard(job_table, pid);
+        if(job_node == NULL){
+            note_early_exit(pid, status, &usage);
+        }
+        // Only this thread closes the pipes and frees jobs
+        if(job_node != NULL && job_node->stdout_fd == -1 && job_node->stderr_fd == -1){
+            finish_job(job_table, job_node);
+        }
+    }
+}
 
-		JobNode *job_node = start_job(exe_file, command_args);
-//	        if(job_node != NULL){
-		    add_job(job_list, job_node);
-		    FD_SET(job_node->stdout_fd, all_fds);
-		    FD_SET(job_node->stderr_fd, all_fds);
-//		}
-		char job_created[BUFSIZE];
-                if(snprintf(job_created, BUFSIZE, "[SERVER] Job %d created\r\n", job_node->pid) < 0){
-                        perror("Job created but cannot print out name");
-                }
-		if(write(fd, job_created, strlen(job_created)) == -1){
-                    perror("writing to client after too many jobs failed");
-                    return fd;
-                }
-		return 0;
-	    }
-	    else{
-		char *max_jobs = "[SERVER] MAXJOBS exceeded\r\n";
-		if(write(fd, max_jobs, strlen(max_jobs)) == -1){
-		    perror("writing to client after too many jobs failed");
-		    return fd;
-		}
+/* Tells every client of the reactor that the server is shutting down and
+ * closes them.
+ */
+void close_all_clients(Reactor *reactor, JobTable *job_table){
+    Client *current = reactor->clients.first;
+    while(current != NULL){
+	// Best effort: the sockets are non-blocking and are not waited on
+	if(current->protocol == PROTO_BINARY){
+	    Chunk *notice = bin_chunk_new(BIN_EV_SHUTDOWN, BIN_OK, 0, 0);
+	    send_to_client(current, notice);
+	    if(notice != NULL){
+		chunk_unref(notice);
 	    }
 	}
-	else if(strcmp(token, "kill") == 0){ // kills given pid
-	    token = strtok(NULL, " "); // gets the pid
-	    int kill_this_pid = strtol(token, NULL, 10);
-	    int killed_job = kill_job(job_list, kill_this_pid);
-	    if(killed_job == 1){ // job not found
-		char *kill_msg = "[SERVER] Job %d not found\r\n";
-		char final_kill_write[BUFSIZE];
-		snprintf(final_kill_write, BUFSIZE, kill_msg, kill_this_pid);
-		if(write(fd, final_kill_write, strlen(final_kill_write)) == -1){
-		    perror("Error writing job not found when trying to kill with kill_job");
-		}
-	    }
-	    else if(killed_job == -1){ // error
-		perror("error finding job and killing it with kill_job");
-	    }
-	    else{ // success
-		mark_job_dead(job_list, kill_this_pid, kill_this_pid+1);
-		remove_job(job_list, kill_this_pid);
-	    }
+	else{
+	    send_reply(current, "[SERVER] Shutting down\r\n");
 	}
-	else if(strcmp(token, "watch") == 0){ // watches clients
+	flush_client(current);
+	drop_client_runs(current);
+	drop_client_spawns(current);
+	unwatch_all_jobs(job_table, current);
+	drop_client_coalesce(current);
+	Client *next = current->next;
+	close(current->socket_fd);
+	remove_client(current);
+	current = next;
+    }
+}
 
-	}
-	for(int i = 0; i < ll; i++){
-            str[i] = '\0';
-        }
+/*
+ *  Metrics port
+ */
 
+/* Accepts every pending connection to the metrics port, to be answered
+ * by reactor 0 once its request has arrived.
+ */
+void accept_scrapes(void){
+    int fd;
+    while((fd = accept4(metrics_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1){
+        Scrape *scrape = malloc(sizeof(Scrape));
+        if(scrape == NULL){
+            log_perror("malloc");
+            close(fd);
+            continue;
+        }
+        scrape->matched = 0;
+        event_source_init(&(scrape->event), EV_METRICS_CLIENT, fd, scrape);
+        if(reactor_add(reactors[0].epoll_fd, &(scrape->event), EPOLLIN | EPOLLET) == -1){
+            close(fd);
+            free(scrape);
+        }
+    }
+    if(errno != EAGAIN && errno != EWOULDBLOCK){
+        log_perror("accept4");
     }
-    return 0;
 }
 
-/* Read characters from fd and store them in buffer. Announce each message found
- * to watchers of job_node with the given format, eg. "[JOB %d] %s\n".
+void close_scrape(Scrape *scrape){
+    reactor_remove(reactors[0].epoll_fd, &(scrape->event));
+    close(scrape->event.fd);
+    free(scrape);
+}
+
+/* Reads a scrape's HTTP request up to the blank line ending its headers,
+ * then answers with the server's metrics and closes the connection. The
+ * reply is small enough to be written at once; whatever the socket does
+ * not take is dropped.
  */
-void process_job_output(JobNode *job_node, int fd, Buffer *buffer, char *format){
-    int num_read = read(fd, buffer->buf, BUFSIZE);
-    printf("BUFFER IN PROCESS JOB OUTPUT IS: %s\n", buffer->buf);
-    if(num_read == -1){
-	perror("Error reading from process_job_output");
+void serve_scrape(Scrape *scrape){
+    const char *end = "\r\n\r\n";
+    char buf[BUFSIZE];
+    int num_read;
+    while(scrape->matched < 4 && (num_read = read(scrape->event.fd, buf, sizeof(buf))) > 0){
+        for(int i = 0; i < num_read && scrape->matched < 4; i++){
+            if(buf[i] == end[scrape->matched]){
+                scrape->matched++;
+            }
+            else{
+                scrape->matched = buf[i] == '\r';
+            }
+        }
     }
-    else if(num_read == 0){
-	perror("file fd is closed process_job_output");
+    if(scrape->matched < 4){
+        if(num_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+            return;
+        }
+        close_scrape(scrape);
+        return;
     }
-    else{
-	printf(format, job_node->pid, buffer->buf);
+    Chunk *body = metrics_chunk(1);
+    if(body != NULL){
+        char header[128];
+        int len = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+                           "Content-Type: text/plain; version=0.0.4\r\n"
+                           "Content-Length: %d\r\nConnection: close\r\n\r\n", body->len);
+        struct iovec iov[2] = {{header, len}, {body->data, body->len}};
+        if(writev(scrape->event.fd, iov, 2) == -1){
+            log_perror("writev metrics");
+        }
+        chunk_unref(body);
     }
+    close_scrape(scrape);
 }
 
-/* Frees up all memory and exits.
+/* Kills and reaps every job, frees up all memory and exits. Only called
+ * once reactor 0 is the last thread left.
  */
-void clean_exit(int listen_fd, Client *clients, JobList *job_list, int exit_status){
-    int i = 0;
-    char *buf = "[SERVER] Shutting down\r\n";
-    char msg[BUFSIZE + 2];
-    strcpy(msg ,buf);
-    while(clients[i].socket_fd != -1){
-	if(write(clients[i].socket_fd, msg, strlen(msg)) == -1){
-	    perror("write failed\n");
-	    exit(1);
+void clean_exit(JobTable *job_table, int exit_status){
+    for(int i = 0; i < num_reactors; i++){
+	close_all_clients(&reactors[i], job_table);
+	close(reactors[i].epoll_fd);
+	close(reactors[i].listen_fd);
+	if(i > 0){
+	    close(reactors[i].wakeup_fd);
+	}
+    }
+    if(metrics_fd != -1){
+	close(metrics_fd);
+    }
+    if(flush_timer_fd != -1){
+	close(flush_timer_fd);
+    }
+    // The zygote exits once its socket is closed
+    if(zygote_fd != -1){
+	close(zygote_fd);
+    }
+    while(pending_spawns != NULL){
+	PendingSpawn *pending = pending_spawns;
+	pending_spawns = pending->next;
+	if(pending->reply != NULL){
+	    chunk_unref(pending->reply);
+	}
+	free(pending->request);
+	free(pending);
+    }
+    while(early_exits != NULL){
+	EarlyExit *early = early_exits;
+	early_exits = early->next;
+	free(early);
+    }
+    // The zygote starts jobs as the server's children, which would
+    // otherwise be left running
+    for(int i = 0; i < JOB_SHARDS; i++){
+	JobList *job_list = &(job_table->shards[i]);
+	kill_all_jobs(job_list);
+	for(JobNode *job = job_list->first; job != NULL; job = job->next){
+	    if(!job->dead && waitpid(job->pid, NULL, 0) == -1){
+		log_perror("waitpid");
+	    }
 	}
-	close(clients[i].socket_fd);
-	i++;
     }
-    empty_job_list(job_list);
+    empty_job_table(job_table);
+#ifdef POOL_STATS
+    Pool *pools[] = {&job_pool, &watcher_pool, &client_pool, &raw_watcher_pool};
+    for(int i = 0; i < sizeof(pools) / sizeof(pools[0]); i++){
+        pool_print_stats(pools[i], stderr);
+    }
+    for(int i = 0; i < BUF_CLASSES; i++){
+        pool_print_stats(&buffer_pools[i], stderr);
+    }
+#endif
     exit(exit_status);
 }
 
-int main(void) {
+/* Sets up the reactor's epoll instance with its own non-blocking listening
+ * socket. With more than one reactor the sockets share the port with
+ * SO_REUSEPORT.
+ * Exits on failure.
+ */
+void init_reactor(Reactor *reactor, int id, struct sockaddr_in *self){
+    reactor->id = id;
+    reactor->clients.first = NULL;
+    reactor->clients.count = 0;
+    reactor->closing_clients = NULL;
+    reactor->listen_fd = setup_server_socket(self, listen_backlog, num_reactors > 1,
+                                             defer_accept);
+    if (set_nonblocking(reactor->listen_fd) == -1) {
+        exit(1);
+    }
+
+    // Every fd we wait on is registered with epoll along with a pointer to
+    // its event source, so only the ready fds are visited each iteration.
+    reactor->epoll_fd = reactor_create();
+    if (reactor->epoll_fd == -1) {
+        exit(1);
+    }
+    event_source_init(&(reactor->listen_event), EV_LISTEN, reactor->listen_fd, NULL);
+    if (reactor_add(reactor->epoll_fd, &(reactor->listen_event), EPOLLIN) == -1) {
+        exit(1);
+    }
+    reactor->wakeup_fd = -1;
+    if (id > 0) {
+        reactor->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        event_source_init(&(reactor->wakeup_event), EV_WAKEUP, reactor->wakeup_fd, NULL);
+        if (reactor->wakeup_fd == -1 ||
+            reactor_add(reactor->epoll_fd, &(reactor->wakeup_event), EPOLLIN) == -1) {
+            log_perror("eventfd");
+            exit(1);
+        }
+    }
+}
+
+/* Runs the reactor's event loop until SIGINT is received on the main
+ * thread, or the main thread asks the other reactors to stop.
+ */
+void run_reactor(Reactor *reactor, int signal_fd){
+    struct epoll_event events[MAX_EVENTS];
+    current_reactor = reactor;
+
+    while (1) {
+        int nready = epoll_wait(reactor->epoll_fd, events, MAX_EVENTS, -1);
+	if(sigint_received == 1 || __atomic_load_n(&shutting_down, __ATOMIC_ACQUIRE)){
+	    break;
+	}
+        if (nready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_perror("server: epoll_wait\n");
+            exit(1);
+        }
+        long busy_start = metrics_now();
+        metric_add(&(reactor->metrics.counters[MET_LOOP_ITERATIONS]), 1);
+
+        for (int i = 0; i < nready; i++) {
+            EventSource *source = events[i].data.ptr;
+            switch (source->type) {
+            case EV_LISTEN: // Accept incoming connections
+                accept_clients(reactor);
+                break;
+            case EV_WAKEUP:
+                break;
+            case EV_METRICS_LISTEN:
+                accept_scrapes();
+                break;
+            case EV_METRICS_CLIENT:
+                serve_scrape(source->owner);
+                break;
+            case EV_JOB_STDOUT:
+            case EV_JOB_STDERR: {
+                JobNode *job = source->owner;
+                if(source->type == EV_JOB_STDOUT){
+                    process_job_output(&job_table, job, source, &(job->stdout_buffer));
+                }
+                else{
+                    process_job_output(&job_table, job, source, &(job->stderr_buffer));
+                }
+                // Neither pipe can have another event pending once both
+                // are closed, so the job can be freed here if it was reaped.
+                if(job->dead && job->stdout_fd == -1 && job->stderr_fd == -1){
+                    finish_job(&job_table, job);
+                }
+                break;
+            }
+            case EV_SIGCHLD:
+                reap_children(signal_fd, &job_table);
+                break;
+            case EV_ZYGOTE:
+                // Room is made as the zygote reads, and it replies as it does
+                send_unsent_spawns(&job_table);
+                receive_spawns(&job_table);
+                break;
+            case EV_FLUSH_TIMER:
+                flush_due_watchers();
+                break;
+            case EV_CLIENT: { // Process requests or deal with dead connections
+                Client *client = source->owner;
+                pthread_mutex_lock(&(client->lock));
+                int closing = client->closing;
+                pthread_mutex_unlock(&(client->lock));
+                if(closing){
+                    mark_client_closing(client);
+                    break;
+                }
+                // Every command read now is handled before any reply is
+                // written, so the replies go out in a single writev
+                if(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)){
+                    if(process_client_request(client, &job_table) > 0){// closed
+                        mark_client_closing(client);
+                        break;
+                    }
+                }
+                flush_client(client);
+                break;
+            }
+            }
+        }
+        close_marked_clients(reactor, &job_table);
+        // Another reactor taking it would leave the queued runs waiting for
+        // reactor 0's next event
+        if(reactor == &reactors[0] && __atomic_exchange_n(&slot_freed, 0, __ATOMIC_ACQ_REL)){
+            dispatch_runs(&job_table);
+        }
+        histogram_record(&(reactor->metrics.loop_busy), metrics_now() - busy_start);
+	// A SIGINT taken while handling the events did not interrupt epoll_wait
+	if(sigint_received == 1){
+	    break;
+	}
+    }
+}
+
+/* Entry point of the threads running reactors other than reactor 0.
+ */
+void *reactor_thread(void *arg){
+    run_reactor(arg, -1);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
     // This line causes stdout and stderr not to be buffered.
     // Don't change this! Necessary for autotesting.
     setbuf(stdout, NULL);
     setbuf(stderr, NULL);
 
+    int opt;
+    int metrics_port = 0;
+    int level;
+    char *end;
+    while ((opt = getopt(argc, argv, "t:m:b:d:vl:sc:")) != -1) {
+        switch (opt) {
+        case 't':
+            num_reactors = strtol(optarg, NULL, 10);
+            break;
+        case 'm':
+            metrics_port = strtol(optarg, NULL, 10);
+            break;
+        case 'b':
+            listen_backlog = strtol(optarg, NULL, 10);
+            break;
+        case 'd':
+            defer_accept = strtol(optarg, NULL, 10);
+            break;
+        case 'v':
+            log_connections = 1;
+            break;
+        case 'l':
+            level = log_level_named(optarg);
+            if (level == -1) {
+                fprintf(stderr, "%s: log level must be error, warn, info or debug\n", argv[0]);
+                exit(1);
+            }
+            log_level = level;
+            break;
+        case 's':
+            compat_logging = 1;
+            break;
+        case 'c':
+            default_coalesce_us = strtol(optarg, &end, 10);
+            if (*end == ':') {
+                default_coalesce_bytes = strtol(end + 1, NULL, 10);
+            }
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-t threads] [-m metrics port] [-b backlog] "
+                    "[-d defer accept seconds] [-v] [-l log level] [-s] [-c usec[:bytes]]\n",
+                    argv[0]);
+            exit(1);
+        }
+    }
+    if (num_reactors < 1 || num_reactors > MAX_REACTORS) {
+        fprintf(stderr, "%s: threads must be between 1 and %d\n", argv[0], MAX_REACTORS);
+        exit(1);
+    }
+    if (listen_backlog < 1 || defer_accept < 0) {
+        fprintf(stderr, "%s: backlog must be positive and defer accept seconds not negative\n",
+                argv[0]);
+        exit(1);
+    }
+    if (default_coalesce_us < 0 || default_coalesce_us > COALESCE_US_MAX ||
+        default_coalesce_bytes < 1 || default_coalesce_bytes > OUTQ_HIGH_WATER) {
+        fprintf(stderr, "%s: coalesce must be at most %d us and 1 to %d bytes\n", argv[0],
+                COALESCE_US_MAX, OUTQ_HIGH_WATER);
+        exit(1);
+    }
+
+    // Jobs are started by a zygote forked now, while the server is small
+    // and has nothing open that a job could inherit
+    zygote_fd = zygote_start(&zygote_pid);
+    if (zygote_fd == -1) {
+        exit(1);
+    }
+
     struct sockaddr_in *self = init_server_addr(PORT);
-    // TODO: Set up server socket
-    int listen_fd = setup_server_socket(self, QUEUE_LENGTH);
-
-
-    // TODO: Set up SIGCHLD handler
-/*    struct sigaction newact_sigchld;
-    newact_sigchld.sa_handler = sigchld_handler;
-    newact_sigchld.sa_flags = 0;
-    sigemptyset(&newact_sigchld.sa_mask);
-    sigaction(SIGCHLD, &newact_sigchld, NULL);
-*/
-    // TODO: Set up SIGINT handler
+
+    // SIGCHLD is blocked and read from a signalfd in the event loop instead
+    // of being handled asynchronously, so it never interrupts epoll_wait.
+    // SIGINT is blocked while the other reactor threads are created so
+    // that only the main thread receives it.
+    sigset_t sigchld_mask;
+    sigset_t startup_mask;
+    sigemptyset(&sigchld_mask);
+    sigaddset(&sigchld_mask, SIGCHLD);
+    startup_mask = sigchld_mask;
+    sigaddset(&startup_mask, SIGINT);
+    if (pthread_sigmask(SIG_BLOCK, &startup_mask, NULL) != 0) {
+        log_perror("pthread_sigmask");
+        exit(1);
+    }
+    int signal_fd = signalfd(-1, &sigchld_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd == -1) {
+        log_perror("signalfd");
+        exit(1);
+    }
+    // SIGINT only reaches reactor 0's thread, interrupting its epoll_wait
     struct sigaction newact_sigint;
     newact_sigint.sa_handler = sigint_handler;
     newact_sigint.sa_flags = 0;
     sigemptyset(&newact_sigint.sa_mask);
     sigaction(SIGINT, &newact_sigint, NULL);
 
-    // TODO: Initialize client tracking structure (array list)
-    Client clients[MAX_CLIENTS];
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        clients[i].socket_fd = -1;
-	clients[i].buffer.inbuf = 0;
-	clients[i].buffer.buf[0] = '\0';
-    }
-
-    // TODO: Initialize job tracking structure (linked list)
-    //job_list = malloc(sizeof(struct job_list));
-    job_list.first = malloc(sizeof(struct job_node));
-    job_list.count = 0;
-    job_list.first->next = NULL;
-    job_list.first->pid = 0;
-    job_list.first->stdout_fd = 0;
-    job_list.first->stderr_fd = 0;
-    job_list.first->dead = 0;
-
-    // TODO: Set up fd set(s) that we want to pass to select()
-    int max_fd = listen_fd;
-    fd_set all_fds, listen_fds;
-    FD_ZERO(&all_fds);
-    FD_SET(listen_fd, &all_fds);
+    // Writes to a watcher that has gone away must fail with EPIPE rather
+    // than kill the server.
+    signal(SIGPIPE, SIG_IGN);
 
-    while (1) {
-        // Use select to wait on fds, also perform any necessary checks---------------------------------------------------------------------------------------------------------------------------------------
-        // for errors or received signals
+    // Jobs are indexed by pid, so lookups do not depend on MAX_JOBS
+    init_job_table(&job_table);
 
-        // select updates the fd_set it receives, so we always use a copy and retain the original.
-        listen_fds = all_fds;
-        int nready = select(max_fd + 1, &listen_fds, NULL, NULL, NULL);
-	if(sigint_received == 1){
-	    break;
-	}
-        if (nready == -1) {
-            perror("server: select\n");
+    // Clients are allocated on accept and kept in a doubly linked list per
+    // reactor, so the only limit on their number is MAX_CLIENTS.
+    for (int i = 0; i < num_reactors; i++) {
+        init_reactor(&reactors[i], i, self);
+    }
+    free(self);
+    EventSource sigchld_event;
+    event_source_init(&sigchld_event, EV_SIGCHLD, signal_fd, NULL);
+    if (reactor_add(reactors[0].epoll_fd, &sigchld_event, EPOLLIN) == -1) {
+        exit(1);
+    }
+    // Edge-triggered, so reactor 0 only hears the socket has room once a
+    // request was held back for the lack of it
+    event_source_init(&zygote_event, EV_ZYGOTE, zygote_fd, NULL);
+    if (reactor_add(reactors[0].epoll_fd, &zygote_event, EPOLLIN | EPOLLOUT | EPOLLET) == -1) {
+        exit(1);
+    }
+
+    // Watched output held back by collect_watchers is written out by reactor
+    // 0 when this timer goes off
+    flush_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (flush_timer_fd == -1) {
+        log_perror("timerfd_create");
+        exit(1);
+    }
+    event_source_init(&flush_timer_event, EV_FLUSH_TIMER, flush_timer_fd, NULL);
+    if (reactor_add(reactors[0].epoll_fd, &flush_timer_event, EPOLLIN) == -1) {
+        exit(1);
+    }
+
+    // Metrics are served over HTTP for Prometheus to scrape, from reactor 0
+    if (metrics_port > 0) {
+        struct sockaddr_in *metrics_addr = init_server_addr(metrics_port);
+        metrics_fd = setup_server_socket(metrics_addr, QUEUE_LENGTH, 0, 0);
+        free(metrics_addr);
+        event_source_init(&metrics_event, EV_METRICS_LISTEN, metrics_fd, NULL);
+        if (set_nonblocking(metrics_fd) == -1 ||
+            reactor_add(reactors[0].epoll_fd, &metrics_event, EPOLLIN) == -1) {
             exit(1);
         }
-        // Accept incoming connections-------------------------------------------------------------------------------------------------------------------------------------------------------------------------
-	if (FD_ISSET(listen_fd, &listen_fds)) {
-            int client_fd = setup_new_client(listen_fd, clients);
-            if (client_fd < 0) {
-                continue;
-            }
-            if (client_fd > max_fd) {
-                max_fd = client_fd;
-            }
-            FD_SET(client_fd, &all_fds);
-            printf("Accepted connection\n");
-        }
-
-        // Check our job pipes, update max_fd if we got children---------------------------------------------------------------------------------------------------------------------------------------------
-
-	// Updating max_fd
-//	max_fd = get_highest_fd(listen_fd, clients, &job_list);
-	// Checking jobs for msgs waiting to be outputted
-/*	struct job_node *current = NULL;
-	current = job_list.first;
-	char *format = "[JOB %d] %s\n";
-	char *format2 = "*(JOB %d)* %s\n";
-	while(current != NULL){
-	    if(FD_ISSET(current->stdout_fd, &listen_fds)){
-  	        process_job_output(current, current->stdout_fd, &(current->stdout_buffer), format);
-	    }
-	    if(FD_ISSET(current->stderr_fd, &listen_fds)){
-		process_job_output(current, current->stderr_fd, &(current->stderr_buffer), format2);
-	    }
-	    current = current->next;
-	}
-*/      // Check on all the connected clients, process any requests-----------------------------------------------------------------------------------------------------------------------------------------
-        // or deal with any dead connections etc.
-
-	// Check the clients
-	for(int i = 0; i < MAX_CLIENTS; i++){
-	    if(clients[i].socket_fd > -1 && FD_ISSET(clients[i].socket_fd, &listen_fds)){
-		// Process Requests
-		int processed_request_fd = process_client_request(&clients[i], &job_list, &all_fds);
-		if(processed_request_fd > 0){// closed
-		    FD_CLR(processed_request_fd, &all_fds);
-		    // Client Termination
-		    if(close(processed_request_fd) == -1){
-			perror("Closing Request Failed\n");
-		    }
-		    printf("[CLIENT %d] Connection closed\n", clients[i].socket_fd);
-		    remove_client(listen_fd, i, clients, &job_list);
-		}
-		else{
-		    // Logging client msgs
-		    char *client_msg = "[CLIENT %d] %s\n";
-		    printf(client_msg, clients[i].socket_fd, clients[i].buffer.buf);
-		}
-	    }
-	}
-	if(sigint_received == 1){ // TODO probably not needed clean up if not needed
-	    break;
-	}
     }
-    clean_exit(listen_fd, clients, &job_list, 0);
 
+    // Log lines are written by a flusher thread unless -s asks for them to
+    // be written at once, along with every line at the level and in the
+    // format the server has always printed them. Like the reactors, the
+    // flusher is started with SIGINT and SIGCHLD blocked.
+    if (compat_logging) {
+        log_level = LOG_DEBUG;
+    }
+    log_start(!compat_logging);
 
-    free(self);
-    close(listen_fd);
+    for (int i = 1; i < num_reactors; i++) {
+        if (pthread_create(&reactors[i].thread, NULL, reactor_thread, &reactors[i]) != 0) {
+            log_perror("pthread_create");
+            exit(1);
+        }
+    }
+    sigset_t sigint_mask;
+    sigemptyset(&sigint_mask);
+    sigaddset(&sigint_mask, SIGINT);
+    pthread_sigmask(SIG_UNBLOCK, &sigint_mask, NULL);
+
+    run_reactor(&reactors[0], signal_fd);
+
+    // Stop the other reactors before their clients are closed
+    __atomic_store_n(&shutting_down, 1, __ATOMIC_RELEASE);
+    for (int i = 1; i < num_reactors; i++) {
+        uint64_t one = 1;
+        if (write(reactors[i].wakeup_fd, &one, sizeof(one)) == -1) {
+            log_perror("write eventfd");
+        }
+        pthread_join(reactors[i].thread, NULL);
+    }
+    close(signal_fd);
+    clean_exit(&job_table, 0);
     return 0;
 }
-
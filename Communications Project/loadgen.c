@@ -0,0 +1,618 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/tcp.h>
+
+#include "socket.h"
+#include "reactor.h"
+
+/* Load generator for the jobserver. Opens many connections to PORT and
+ * sends a weighted mix of jobs, run, kill and watch commands, either as fast
+ * as the server answers (one command in flight per connection) or at a
+ * target total rate. Reports throughput and p50/p99/p999 latency per
+ * command. kill only replies on failure, so it is sent fire-and-forget and
+ * has no latency. With -P, it fails if the p99 latency over all commands
+ * is above the given number of microseconds.
+ */
+
+#ifndef PORT
+    #define PORT 55555
+#endif
+
+// Longest line read from the server, including its network newline
+#define LOADGEN_LINE_MAX 4096
+
+// Most recently created pids kept as targets for kill and watch
+#define PID_POOL_SIZE 256
+
+// A command with no reply after this long is counted as timed out
+#define REPLY_TIMEOUT_NS (5 * 1000000000LL)
+
+// How long to wait for outstanding replies once the run is over
+#define DRAIN_NS 1000000000LL
+
+#define NS_PER_SEC 1000000000LL
+
+typedef enum {CMD_JOBS, CMD_RUN, CMD_KILL, CMD_WATCH, NUM_CMDS} LoadCommand;
+
+const char *command_names[NUM_CMDS] = {"jobs", "run", "kill", "watch"};
+
+typedef enum {CONN_IDLE, CONN_WAITING, CONN_CLOSED} ConnState;
+
+struct conn {
+        int fd;
+        ConnState state;
+        LoadCommand pending;            // command waiting for a reply
+        int pending_pid;                // pid the pending watch is for
+        long long sent_at;              // when the pending command was sent
+        char buf[LOADGEN_LINE_MAX];
+        int inbuf;
+        EventSource event;
+        struct conn *next_idle;
+};
+typedef struct conn Conn;
+
+/* Latencies of one command, in nanoseconds.
+ */
+struct latencies {
+        long long *samples;
+        int count;
+        int capacity;
+};
+typedef struct latencies Latencies;
+
+struct loadgen {
+        // options
+        int num_conns;
+        double duration;
+        double rate;                    // commands per second, 0 for closed loop
+        int weights[NUM_CMDS];
+        int weight_total;
+        char **job_names;
+        int num_job_names;
+        double max_p99_us;              // 0 for no limit
+
+        int epoll_fd;
+        Conn *conns;
+        Conn *idle;                     // connections with nothing in flight
+        int open_conns;
+        int dropped_conns;              // closed by the server
+
+        int pids[PID_POOL_SIZE];
+        int num_pids;
+        int next_pid;
+
+        long long sent[NUM_CMDS];
+        long long replied[NUM_CMDS];
+        long long maxjobs_rejected;
+        long long queued;
+        long long kill_not_found;
+        long long timeouts;
+        Latencies latency[NUM_CMDS];
+};
+typedef struct loadgen LoadGen;
+
+int sigint_received;
+
+void sigint_handler(int code) {
+    sigint_received = 1;
+}
+
+/* Returns the time of the monotonic clock in nanoseconds.
+ */
+long long now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+/* Records one latency sample. Samples that cannot be stored are dropped.
+ */
+void record_latency(Latencies *latencies, long long ns){
+    if(latencies->count == latencies->capacity){
+        int capacity = latencies->capacity == 0 ? 1024 : latencies->capacity * 2;
+        long long *samples = realloc(latencies->samples, capacity * sizeof(long long));
+        if(samples == NULL){
+            return;
+        }
+        latencies->samples = samples;
+        latencies->capacity = capacity;
+    }
+    latencies->samples[latencies->count++] = ns;
+}
+
+int compare_latency(const void *a, const void *b){
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+/* Returns the p-th quantile of sorted samples, in microseconds.
+ */
+double percentile_us(Latencies *latencies, double p){
+    if(latencies->count == 0){
+        return 0;
+    }
+    int index = (int)(p * latencies->count + 0.999999) - 1;
+    if(index < 0){
+        index = 0;
+    }
+    return latencies->samples[index] / 1000.0;
+}
+
+/* Remembers a pid the server created, as a target for kill and watch.
+ */
+void add_pid(LoadGen *gen, int pid){
+    gen->pids[gen->next_pid] = pid;
+    gen->next_pid = (gen->next_pid + 1) % PID_POOL_SIZE;
+    if(gen->num_pids < PID_POOL_SIZE){
+        gen->num_pids++;
+    }
+}
+
+/* Picks the next command according to the weights. kill and watch fall
+ * back to jobs until some job has been created.
+ */
+LoadCommand pick_command(LoadGen *gen){
+    int r = random() % gen->weight_total;
+    LoadCommand command = CMD_JOBS;
+    for(int i = 0; i < NUM_CMDS; i++){
+        if(r < gen->weights[i]){
+            command = i;
+            break;
+        }
+        r -= gen->weights[i];
+    }
+    if((command == CMD_KILL || command == CMD_WATCH) && gen->num_pids == 0){
+        command = CMD_JOBS;
+    }
+    return command;
+}
+
+void close_conn(LoadGen *gen, Conn *conn){
+    if(conn->state == CONN_CLOSED){
+        return;
+    }
+    close(conn->fd);
+    conn->state = CONN_CLOSED;
+    gen->open_conns--;
+}
+
+void make_idle(LoadGen *gen, Conn *conn){
+    conn->state = CONN_IDLE;
+    conn->next_idle = gen->idle;
+    gen->idle = conn;
+}
+
+/* Sends the next command on an idle connection.
+ */
+void issue_command(LoadGen *gen, Conn *conn){
+    char cmd[128];
+    int len;
+    int pid = 0;
+    LoadCommand command = pick_command(gen);
+    if(command == CMD_KILL || command == CMD_WATCH){
+        pid = gen->pids[random() % gen->num_pids];
+    }
+    switch(command){
+    case CMD_JOBS:
+        len = snprintf(cmd, sizeof(cmd), "jobs\r\n");
+        break;
+    case CMD_RUN:
+        len = snprintf(cmd, sizeof(cmd), "run %s\r\n",
+                       gen->job_names[random() % gen->num_job_names]);
+        break;
+    case CMD_KILL:
+        len = snprintf(cmd, sizeof(cmd), "kill %d\r\n", pid);
+        break;
+    default:
+        len = snprintf(cmd, sizeof(cmd), "watch %d\r\n", pid);
+        break;
+    }
+    // Commands are far smaller than the socket buffer, so a short write
+    // means the server has stopped reading.
+    if(write(conn->fd, cmd, len) != len){
+        close_conn(gen, conn);
+        gen->dropped_conns++;
+        return;
+    }
+    gen->sent[command]++;
+    if(command == CMD_KILL){
+        make_idle(gen, conn);
+        return;
+    }
+    conn->state = CONN_WAITING;
+    conn->pending = command;
+    conn->pending_pid = pid;
+    conn->sent_at = now_ns();
+}
+
+/* Returns 1 if line, without its network newline, is the server's reply
+ * to the command pending on conn.
+ */
+int is_reply(LoadGen *gen, Conn *conn, const char *line){
+    if(strncmp(line, "[SERVER] ", 9) != 0){
+        return 0;   // job output and exit notices of watched jobs
+    }
+    line += 9;
+    int pid;
+    switch(conn->pending){
+    case CMD_JOBS:
+        return (line[0] >= '0' && line[0] <= '9') ||
+               strcmp(line, "No currently running jobs") == 0;
+    case CMD_RUN:
+        if(sscanf(line, "Job %d created", &pid) == 1){
+            add_pid(gen, pid);
+            return 1;
+        }
+        if(strcmp(line, "MAXJOBS exceeded") == 0){
+            gen->maxjobs_rejected++;
+            return 1;
+        }
+        if(sscanf(line, "Run %d queued", &pid) == 1){
+            gen->queued++;
+            return 1;
+        }
+        return 0;
+    case CMD_WATCH:
+        return (sscanf(line, "Watching job %d", &pid) == 1 ||
+                sscanf(line, "No longer watching job %d", &pid) == 1 ||
+                sscanf(line, "Job %d not found", &pid) == 1) &&
+               pid == conn->pending_pid;
+    default:
+        return 0;
+    }
+}
+
+/* Handles one line from the server.
+ */
+void process_line(LoadGen *gen, Conn *conn, char *line){
+    if(conn->state == CONN_WAITING && is_reply(gen, conn, line)){
+        gen->replied[conn->pending]++;
+        record_latency(&(gen->latency[conn->pending]), now_ns() - conn->sent_at);
+        make_idle(gen, conn);
+        return;
+    }
+    int pid;
+    if(sscanf(line, "[SERVER] Job %d not found", &pid) == 1){
+        gen->kill_not_found++;
+    }
+    else if(sscanf(line, "[SERVER] Job %d created", &pid) == 1){
+        add_pid(gen, pid);  // a queued run that has started
+    }
+}
+
+/* Reads everything available on conn and handles each complete line.
+ */
+void read_conn(LoadGen *gen, Conn *conn){
+    while(conn->state != CONN_CLOSED){
+        int nbytes = read(conn->fd, conn->buf + conn->inbuf, LOADGEN_LINE_MAX - conn->inbuf);
+        if(nbytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+            return;
+        }
+        if(nbytes == -1 && errno == EINTR){
+            continue;
+        }
+        if(nbytes <= 0){
+            close_conn(gen, conn);
+            gen->dropped_conns++;
+            return;
+        }
+        conn->inbuf += nbytes;
+
+        int start = 0;
+        char *newline;
+        while((newline = memchr(conn->buf + start, '\n', conn->inbuf - start)) != NULL){
+            int end = newline - conn->buf;
+            if(end > start && conn->buf[end - 1] == '\r'){
+                conn->buf[end - 1] = '\0';
+            }
+            *newline = '\0';
+            process_line(gen, conn, conn->buf + start);
+            start = end + 1;
+        }
+        if(start == 0 && conn->inbuf == LOADGEN_LINE_MAX){
+            conn->inbuf = 0;    // longer than any line the server sends
+        }
+        else{
+            memmove(conn->buf, conn->buf + start, conn->inbuf - start);
+            conn->inbuf -= start;
+        }
+    }
+}
+
+/* Counts commands that have waited too long for a reply as timed out, and
+ * frees their connections for new commands.
+ */
+void expire_waiting(LoadGen *gen, long long now){
+    for(int i = 0; i < gen->num_conns; i++){
+        Conn *conn = &(gen->conns[i]);
+        if(conn->state == CONN_WAITING && now - conn->sent_at > REPLY_TIMEOUT_NS){
+            gen->timeouts++;
+            make_idle(gen, conn);
+        }
+    }
+}
+
+/* Connects every connection to the server.
+ */
+void open_conns(LoadGen *gen, const char *host, int port){
+    // Thousands of connections need more than the default fd limit
+    struct rlimit limit;
+    if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max){
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    gen->conns = calloc(gen->num_conns, sizeof(Conn));
+    if(gen->conns == NULL){
+        perror("calloc");
+        exit(1);
+    }
+    gen->epoll_fd = reactor_create();
+    if(gen->epoll_fd == -1){
+        exit(1);
+    }
+    for(int i = 0; i < gen->num_conns; i++){
+        Conn *conn = &(gen->conns[i]);
+        conn->fd = connect_to_server(port, host);
+        // A fire-and-forget kill is followed at once by the next command,
+        // which Nagle would hold back until the kill is acknowledged.
+        int on = 1;
+        setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        if(set_nonblocking(conn->fd) == -1){
+            exit(1);
+        }
+        event_source_init(&(conn->event), EV_CLIENT, conn->fd, conn);
+        if(reactor_add(gen->epoll_fd, &(conn->event), EPOLLIN | EPOLLET) == -1){
+            exit(1);
+        }
+        gen->open_conns++;
+        make_idle(gen, conn);
+    }
+}
+
+/* Sends commands for the configured duration, then waits for outstanding
+ * replies. Returns the time spent sending, in seconds.
+ */
+double run(LoadGen *gen){
+    struct epoll_event events[MAX_EVENTS];
+    long long start = now_ns();
+    long long end = start + (long long)(gen->duration * NS_PER_SEC);
+    long long issued = 0;
+    long long last_expiry = start;
+    long long now = start;
+
+    while(!sigint_received && gen->open_conns > 0){
+        now = now_ns();
+        if(now >= end){
+            break;
+        }
+        long long due = gen->rate > 0 ? (long long)(gen->rate * (now - start) / NS_PER_SEC) - issued : -1;
+        while(gen->idle != NULL && due != 0){
+            Conn *conn = gen->idle;
+            gen->idle = conn->next_idle;
+            if(conn->state != CONN_IDLE){
+                continue;   // closed while idle
+            }
+            issue_command(gen, conn);
+            issued++;
+            due--;
+        }
+        if(now - last_expiry > NS_PER_SEC / 10){
+            expire_waiting(gen, now);
+            last_expiry = now;
+        }
+
+        // Poll often enough to keep to the rate; otherwise only replies
+        // free connections for new commands.
+        int timeout = gen->rate > 0 ? 1 : (int)((end - now) / 1000000 + 1);
+        int nready = epoll_wait(gen->epoll_fd, events, MAX_EVENTS, timeout);
+        if(nready == -1 && errno != EINTR){
+            perror("epoll_wait");
+            exit(1);
+        }
+        for(int i = 0; i < nready; i++){
+            EventSource *source = events[i].data.ptr;
+            read_conn(gen, source->owner);
+        }
+    }
+    double elapsed = (double)(now - start) / NS_PER_SEC;
+
+    long long drain_end = now_ns() + DRAIN_NS;
+    int waiting = 1;
+    while(!sigint_received && waiting && (now = now_ns()) < drain_end){
+        waiting = 0;
+        for(int i = 0; i < gen->num_conns; i++){
+            waiting |= gen->conns[i].state == CONN_WAITING;
+        }
+        int nready = epoll_wait(gen->epoll_fd, events, MAX_EVENTS, 10);
+        for(int i = 0; i < nready; i++){
+            EventSource *source = events[i].data.ptr;
+            read_conn(gen, source->owner);
+        }
+    }
+    return elapsed;
+}
+
+/* Prints throughput and latency per command.
+ * Returns the p99 latency over all commands, in microseconds.
+ */
+double report(LoadGen *gen, double elapsed){
+    long long total_sent = 0;
+    long long total_replied = 0;
+    Latencies all = {NULL, 0, 0};
+    for(int i = 0; i < NUM_CMDS; i++){
+        total_sent += gen->sent[i];
+        total_replied += gen->replied[i];
+        Latencies *latencies = &(gen->latency[i]);
+        if(latencies->count > 0){
+            qsort(latencies->samples, latencies->count, sizeof(long long), compare_latency);
+        }
+        for(int j = 0; j < latencies->count; j++){
+            record_latency(&all, latencies->samples[j]);
+        }
+    }
+    if(all.count > 0){
+        qsort(all.samples, all.count, sizeof(long long), compare_latency);
+    }
+
+    printf("connections: %d requested, %d dropped by server\n",
+           gen->num_conns, gen->dropped_conns);
+    printf("duration: %.2f s, sent %lld commands (%.0f/s), %lld replies (%.0f/s)\n",
+           elapsed, total_sent, total_sent / elapsed, total_replied, total_replied / elapsed);
+    printf("%-6s %10s %10s %10s %10s %10s %10s\n",
+           "cmd", "sent", "replied", "p50(us)", "p99(us)", "p999(us)", "max(us)");
+    for(int i = 0; i <= NUM_CMDS; i++){
+        Latencies *latencies = i < NUM_CMDS ? &(gen->latency[i]) : &all;
+        if(i == CMD_KILL){
+            // kill has no reply on success
+            printf("%-6s %10lld %10s\n", command_names[i], gen->sent[i], "-");
+            continue;
+        }
+        printf("%-6s %10lld %10lld %10.1f %10.1f %10.1f %10.1f\n",
+               i < NUM_CMDS ? command_names[i] : "all",
+               i < NUM_CMDS ? gen->sent[i] : total_sent,
+               i < NUM_CMDS ? gen->replied[i] : total_replied,
+               percentile_us(latencies, 0.5), percentile_us(latencies, 0.99),
+               percentile_us(latencies, 0.999), percentile_us(latencies, 1.0));
+    }
+    printf("MAXJOBS exceeded: %lld, queued: %lld, kill of finished job: %lld, timed out: %lld\n",
+           gen->maxjobs_rejected, gen->queued, gen->kill_not_found, gen->timeouts);
+    double p99 = percentile_us(&all, 0.99);
+    free(all.samples);
+    return p99;
+}
+
+/* Parses a jobs:run:kill:watch weight mix such as 70:10:10:10.
+ * Returns 0 on success, -1 if it is malformed.
+ */
+int parse_mix(LoadGen *gen, char *mix){
+    gen->weight_total = 0;
+    for(int i = 0; i < NUM_CMDS; i++){
+        char *token = strtok(i == 0 ? mix : NULL, ":");
+        if(token == NULL){
+            return -1;
+        }
+        gen->weights[i] = strtol(token, NULL, 10);
+        if(gen->weights[i] < 0){
+            return -1;
+        }
+        gen->weight_total += gen->weights[i];
+    }
+    return gen->weight_total > 0 ? 0 : -1;
+}
+
+/* Splits a comma separated list of programs in jobs/ to run.
+ */
+void parse_job_names(LoadGen *gen, char *names){
+    gen->num_job_names = 0;
+    for(char *token = strtok(names, ","); token != NULL; token = strtok(NULL, ",")){
+        char **grown = realloc(gen->job_names, (gen->num_job_names + 1) * sizeof(char *));
+        if(grown == NULL){
+            perror("realloc");
+            exit(1);
+        }
+        gen->job_names = grown;
+        gen->job_names[gen->num_job_names++] = token;
+    }
+}
+
+void usage(char *prog){
+    fprintf(stderr, "Usage: %s [-c connections] [-d seconds] [-r rate] "
+            "[-m jobs:run:kill:watch] [-j job[,job...]] [-H host] [-p port] [-s seed] "
+            "[-P max p99 us]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    setbuf(stdout, NULL);
+
+    LoadGen gen;
+    memset(&gen, 0, sizeof(gen));
+    gen.num_conns = 100;
+    gen.duration = 10;
+    char default_mix[] = "70:10:10:10";
+    char default_jobs[] = "fastjob";
+    char *mix = default_mix;
+    char *jobs = default_jobs;
+    char *host = "localhost";
+    int port = PORT;
+    unsigned int seed = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:d:r:m:j:H:p:s:P:")) != -1) {
+        switch (opt) {
+        case 'c':
+            gen.num_conns = strtol(optarg, NULL, 10);
+            break;
+        case 'd':
+            gen.duration = strtod(optarg, NULL);
+            break;
+        case 'r':
+            gen.rate = strtod(optarg, NULL);
+            break;
+        case 'm':
+            mix = optarg;
+            break;
+        case 'j':
+            jobs = optarg;
+            break;
+        case 'H':
+            host = optarg;
+            break;
+        case 'p':
+            port = strtol(optarg, NULL, 10);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 10);
+            break;
+        case 'P':
+            gen.max_p99_us = strtod(optarg, NULL);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (gen.num_conns < 1 || gen.duration <= 0 || gen.rate < 0 || gen.max_p99_us < 0 || parse_mix(&gen, mix) == -1) {
+        usage(argv[0]);
+    }
+    parse_job_names(&gen, jobs);
+    if (gen.num_job_names == 0) {
+        usage(argv[0]);
+    }
+    srandom(seed);
+
+    struct sigaction newact_sigint;
+    newact_sigint.sa_handler = sigint_handler;
+    newact_sigint.sa_flags = 0;
+    sigemptyset(&newact_sigint.sa_mask);
+    sigaction(SIGINT, &newact_sigint, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    open_conns(&gen, host, port);
+    double elapsed = run(&gen);
+    double p99 = report(&gen, elapsed);
+
+    for (int i = 0; i < gen.num_conns; i++) {
+        close_conn(&gen, &gen.conns[i]);
+    }
+    for (int i = 0; i < NUM_CMDS; i++) {
+        free(gen.latency[i].samples);
+    }
+    free(gen.conns);
+    free(gen.job_names);
+    close(gen.epoll_fd);
+    if (gen.max_p99_us > 0 && p99 > gen.max_p99_us) {
+        fprintf(stderr, "loadgen: p99 of %.1f us is over the limit of %.1f us\n",
+                p99, gen.max_p99_us);
+        return 1;
+    }
+    return 0;
+}
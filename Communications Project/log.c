@@ -0,0 +1,292 @@
+#define _GNU_SOURCE // strerror_r returning a string
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "log.h"
+
+#define LOG_RING_MASK (LOG_RING_SIZE - 1)
+
+/* A line in the ring. seq says whose turn the slot is: a thread logging a
+ * line may claim it when seq is the slot's position, and the flusher may
+ * write it out once seq is one past that.
+ */
+struct log_slot {
+        unsigned long seq;
+        LogLevel level;
+        int len;
+        char *text;             // inline_text, or allocated for a long line
+        char inline_text[LOG_INLINE];
+};
+typedef struct log_slot LogSlot;
+
+LogLevel log_level = LOG_DEBUG;
+
+static const char *level_names[] = {"error", "warn", "info", "debug"};
+
+// Lines are claimed at ring_tail by any thread and written out from
+// ring_head by the flusher alone, so neither end takes a lock
+static LogSlot ring[LOG_RING_SIZE];
+static unsigned long ring_tail;
+static unsigned long ring_head;
+static long dropped;
+
+static int async_logging;
+static int exit_registered;
+static pthread_t flusher;
+
+// The flusher sleeps on flusher_wakeup while idle is set. Only a thread
+// that clears idle takes the lock, once per idle period.
+static pthread_mutex_t flusher_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusher_wakeup = PTHREAD_COND_INITIALIZER;
+static int flusher_idle;
+static int stopping;
+
+/* Returns the level named by str, or -1 if there is none.
+ */
+int log_level_named(const char *str){
+    for(int i = LOG_ERROR; i <= LOG_DEBUG; i++){
+        if(strcmp(str, level_names[i]) == 0){
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int level_fd(LogLevel level){
+    return level <= LOG_WARN ? STDERR_FILENO : STDOUT_FILENO;
+}
+
+/* Returns whether the next line for the flusher has been written.
+ */
+static int line_ready(void){
+    LogSlot *slot = &ring[ring_head & LOG_RING_MASK];
+    return __atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE) == ring_head + 1;
+}
+
+/* Claims the next free slot of the ring and sets pos to its position.
+ * Returns NULL if the ring is full.
+ */
+static LogSlot *claim_slot(unsigned long *pos){
+    unsigned long tail = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+    while(1){
+        LogSlot *slot = &ring[tail & LOG_RING_MASK];
+        long lag = (long)(__atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE) - tail);
+        if(lag == 0){
+            // On failure tail is updated to the latest value
+            if(__atomic_compare_exchange_n(&ring_tail, &tail, tail + 1, 1,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+                *pos = tail;
+                return slot;
+            }
+        }
+        else if(lag < 0){
+            // The flusher has yet to write out the line a lap ahead
+            return NULL;
+        }
+        else{
+            tail = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/* Writes out count buffers in full, retrying short writes. Lines that
+ * cannot be written are lost; there is nowhere left to report it.
+ */
+static void write_lines(int fd, struct iovec *iov, int count){
+    while(count > 0){
+        ssize_t written = writev(fd, iov, count);
+        if(written == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            return;
+        }
+        while(count > 0 && (size_t)written >= iov->iov_len){
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if(count > 0){
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+}
+
+/* Writes out every line ready in the ring, up to LOG_BATCH consecutive
+ * lines for the same fd per writev, and reports dropped lines where they
+ * would have been.
+ * Returns the number of lines written.
+ */
+static int flush_ring(void){
+    struct iovec iov[LOG_BATCH];
+    int flushed = 0;
+    while(1){
+        int count = 0;
+        int fd = -1;
+        unsigned long pos = ring_head;
+        while(count < LOG_BATCH){
+            LogSlot *slot = &ring[pos & LOG_RING_MASK];
+            if(__atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE) != pos + 1 ||
+               (count > 0 && level_fd(slot->level) != fd)){
+                break;
+            }
+            fd = level_fd(slot->level);
+            iov[count].iov_base = slot->text;
+            iov[count].iov_len = slot->len;
+            count++;
+            pos++;
+        }
+        long lost = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+        if(count == 0 && lost == 0){
+            return flushed;
+        }
+        write_lines(fd, iov, count);
+        // The slots are handed back for the next lap of the ring
+        for(; ring_head < pos; ring_head++){
+            LogSlot *slot = &ring[ring_head & LOG_RING_MASK];
+            if(slot->text != slot->inline_text){
+                free(slot->text);
+            }
+            __atomic_store_n(&(slot->seq), ring_head + LOG_RING_SIZE, __ATOMIC_RELEASE);
+        }
+        if(lost > 0){
+            dprintf(STDERR_FILENO, "log: %ld lines dropped\n", lost);
+        }
+        flushed += count;
+    }
+}
+
+/* The flusher thread: writes out lines as they are logged, in batches
+ * while lines keep coming, and sleeps while there are none.
+ */
+static void *flush_log(void *arg){
+    while(1){
+        if(flush_ring() > 0){
+            continue;
+        }
+        pthread_mutex_lock(&flusher_lock);
+        __atomic_store_n(&flusher_idle, 1, __ATOMIC_RELAXED);
+        // Pairs with the fence in log_write: either the line is seen here
+        // or idle is seen there
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        while(__atomic_load_n(&flusher_idle, __ATOMIC_RELAXED) && !stopping && !line_ready()){
+            pthread_cond_wait(&flusher_wakeup, &flusher_lock);
+        }
+        __atomic_store_n(&flusher_idle, 0, __ATOMIC_RELAXED);
+        int stop = stopping;
+        pthread_mutex_unlock(&flusher_lock);
+        if(stop){
+            flush_ring();
+            return NULL;
+        }
+    }
+}
+
+/* Starts logging. With async, lines are queued in a ring and written in
+ * batches by a flusher thread, so logging never blocks the caller.
+ * Otherwise every line is written at once through the unbuffered stdio
+ * streams. Either way the same lines are written, in the same format.
+ * Lines logged before this are written at once.
+ */
+void log_start(int async){
+    if(!exit_registered){
+        exit_registered = 1;
+        atexit(log_stop);
+    }
+    if(!async || async_logging){
+        return;
+    }
+    for(unsigned long i = 0; i < LOG_RING_SIZE; i++){
+        ring[i].seq = ring_tail + i;
+    }
+    ring_head = ring_tail;
+    stopping = 0;
+    int result = pthread_create(&flusher, NULL, flush_log, NULL);
+    if(result != 0){
+        fprintf(stderr, "log: pthread_create: %s\n", strerror(result));
+        return;
+    }
+    __atomic_store_n(&async_logging, 1, __ATOMIC_RELEASE);
+}
+
+/* Writes out every queued line and stops the flusher thread. Lines logged
+ * afterwards are written at once. Also run at exit.
+ */
+void log_stop(void){
+    if(!__atomic_load_n(&async_logging, __ATOMIC_ACQUIRE)){
+        return;
+    }
+    pthread_mutex_lock(&flusher_lock);
+    stopping = 1;
+    pthread_cond_signal(&flusher_wakeup);
+    pthread_mutex_unlock(&flusher_lock);
+    pthread_join(flusher, NULL);
+    __atomic_store_n(&async_logging, 0, __ATOMIC_RELEASE);
+    // Lines that raced with the flusher's last pass
+    flush_ring();
+}
+
+/* Logs a formatted line at the given level. Lines dropped because the
+ * ring is full are counted and reported in their place.
+ */
+void log_write(LogLevel level, const char *format, ...){
+    if(level > log_level){
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    if(!__atomic_load_n(&async_logging, __ATOMIC_ACQUIRE)){
+        vfprintf(level_fd(level) == STDERR_FILENO ? stderr : stdout, format, args);
+        va_end(args);
+        return;
+    }
+    unsigned long pos;
+    LogSlot *slot = claim_slot(&pos);
+    if(slot == NULL){
+        va_end(args);
+        __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    va_list copy;
+    va_copy(copy, args);
+    int len = vsnprintf(slot->inline_text, LOG_INLINE, format, args);
+    slot->text = slot->inline_text;
+    if(len >= LOG_INLINE){
+        char *text = malloc(len + 1);
+        if(text != NULL){
+            vsnprintf(text, len + 1, format, copy);
+            slot->text = text;
+        }
+        else{
+            len = LOG_INLINE - 1;
+        }
+    }
+    va_end(copy);
+    va_end(args);
+    slot->len = len < 0 ? 0 : len;
+    slot->level = level;
+    __atomic_store_n(&(slot->seq), pos + 1, __ATOMIC_RELEASE);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&flusher_idle, __ATOMIC_RELAXED) &&
+       __atomic_exchange_n(&flusher_idle, 0, __ATOMIC_RELAXED)){
+        pthread_mutex_lock(&flusher_lock);
+        pthread_cond_signal(&flusher_wakeup);
+        pthread_mutex_unlock(&flusher_lock);
+    }
+}
+
+/* Logs msg and the description of errno as an error, like perror.
+ */
+void log_perror(const char *msg){
+    int error = errno;
+    char buf[128];
+    log_error("%s: %s\n", msg, strerror_r(error, buf, sizeof(buf)));
+    errno = error;
+}
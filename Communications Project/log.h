@@ -0,0 +1,57 @@
+#ifndef _LOG_H_
+#define _LOG_H_
+
+#include <stdarg.h>
+
+// Lines of up to this many bytes are formatted straight into the ring;
+// longer ones are allocated
+#define LOG_INLINE 240
+
+// Lines the ring holds before new ones are dropped, a power of two
+#ifndef LOG_RING_SIZE
+    #define LOG_RING_SIZE 4096
+#endif
+
+// Most lines handed to a single writev call by the flusher
+#define LOG_BATCH 64
+
+/* Log levels, most severe first. Errors and warnings go to stderr and the
+ * rest to stdout, as the server has always written them.
+ */
+typedef enum {LOG_ERROR, LOG_WARN, LOG_INFO, LOG_DEBUG} LogLevel;
+
+// Lines less severe than this are not logged
+extern LogLevel log_level;
+
+/* Returns the level named by str, or -1 if there is none.
+ */
+int log_level_named(const char *);
+
+/* Starts logging. With async, lines are queued in a ring and written in
+ * batches by a flusher thread, so logging never blocks the caller.
+ * Otherwise every line is written at once through the unbuffered stdio
+ * streams. Either way the same lines are written, in the same format.
+ * Lines logged before this are written at once.
+ */
+void log_start(int async);
+
+/* Writes out every queued line and stops the flusher thread. Lines logged
+ * afterwards are written at once. Also run at exit.
+ */
+void log_stop(void);
+
+/* Logs a formatted line at the given level. Lines dropped because the
+ * ring is full are counted and reported in their place.
+ */
+void log_write(LogLevel, const char *, ...) __attribute__((format(printf, 2, 3)));
+
+/* Logs msg and the description of errno as an error, like perror.
+ */
+void log_perror(const char *);
+
+#define log_error(...) log_write(LOG_ERROR, __VA_ARGS__)
+#define log_warn(...) log_write(LOG_WARN, __VA_ARGS__)
+#define log_info(...) log_write(LOG_INFO, __VA_ARGS__)
+#define log_debug(...) log_write(LOG_DEBUG, __VA_ARGS__)
+
+#endif
@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "metrics.h"
+
+// Powers of two of nanoseconds reported as Prometheus histogram buckets,
+// from about a microsecond up
+#define PROM_MIN_BITS 10
+
+/* Returns the time of the monotonic clock in nanoseconds.
+ */
+long metrics_now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* Returns the histogram bucket that holds value.
+ */
+static int bucket_index(long value){
+    if(value < HIST_SUB){
+        return value < 0 ? 0 : value;
+    }
+    int msb = 63 - __builtin_clzl(value);
+    if(msb >= HIST_MAX_BITS){
+        return HIST_BUCKETS - 1;
+    }
+    int shift = msb - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (value >> shift) - HIST_SUB;
+}
+
+/* Returns the highest value held by a histogram bucket.
+ */
+static long bucket_high(int index){
+    if(index < HIST_SUB){
+        return index;
+    }
+    int shift = index / HIST_SUB - 1;
+    return ((long)(HIST_SUB + index % HIST_SUB) << shift) + (1L << shift) - 1;
+}
+
+/* Records a value in a histogram owned by the calling thread.
+ */
+void histogram_record(Histogram *histogram, long value){
+    metric_add(&(histogram->counts[bucket_index(value)]), 1);
+    metric_add(&(histogram->count), 1);
+    metric_add(&(histogram->sum), value);
+    if(value > histogram->max){
+        __atomic_store_n(&(histogram->max), value, __ATOMIC_RELAXED);
+    }
+}
+
+/* Returns the value below which the given fraction of a histogram's values
+ * fall, as the highest value of the bucket it is found in. Returns 0 for an
+ * empty histogram.
+ */
+long histogram_percentile(Histogram *histogram, double fraction){
+    long total = 0;
+    for(int i = 0; i < HIST_BUCKETS; i++){
+        total += histogram->counts[i];
+    }
+    long target = fraction * total + 0.5;
+    target = target < 1 ? 1 : target;
+    long seen = 0;
+    for(int i = 0; i < HIST_BUCKETS && total > 0; i++){
+        seen += histogram->counts[i];
+        if(seen >= target){
+            long high = bucket_high(i);
+            return high < histogram->max ? high : histogram->max;
+        }
+    }
+    return 0;
+}
+
+/* Counts a command and records how long it took since start, from
+ * metrics_now.
+ */
+void metrics_command(Metrics *metrics, int command, long start){
+    int index = command >= 0 && command < N_JOB_COMMANDS ? command : N_JOB_COMMANDS;
+    metric_add(&(metrics->commands[index]), 1);
+    histogram_record(&(metrics->command_latency), metrics_now() - start);
+}
+
+static long load(long *value){
+    return __atomic_load_n(value, __ATOMIC_RELAXED);
+}
+
+static void sum_histogram(Histogram *total, Histogram *histogram){
+    for(int i = 0; i < HIST_BUCKETS; i++){
+        total->counts[i] += load(&(histogram->counts[i]));
+    }
+    total->count += load(&(histogram->count));
+    total->sum += load(&(histogram->sum));
+    long max = load(&(histogram->max));
+    if(max > total->max){
+        total->max = max;
+    }
+}
+
+/* Adds a snapshot of metrics, which may be updated meanwhile, to total.
+ */
+void metrics_sum(Metrics *total, Metrics *metrics){
+    for(int i = 0; i < NUM_COUNTERS; i++){
+        total->counters[i] += load(&(metrics->counters[i]));
+    }
+    for(int i = 0; i <= N_JOB_COMMANDS; i++){
+        total->commands[i] += load(&(metrics->commands[i]));
+    }
+    sum_histogram(&(total->loop_busy), &(metrics->loop_busy));
+    sum_histogram(&(total->command_latency), &(metrics->command_latency));
+}
+
+/* Writes a line summarizing a histogram of nanoseconds in microseconds.
+ */
+static void write_histogram_text(FILE *stream, const char *name, Histogram *histogram){
+    double mean = histogram->count > 0 ? (double)histogram->sum / histogram->count : 0;
+    fprintf(stream, "[SERVER] %s: %ld samples, mean %.1fus, p50 %.1fus, p90 %.1fus, "
+            "p99 %.1fus, max %.1fus\r\n", name, histogram->count, mean / 1000,
+            histogram_percentile(histogram, 0.5) / 1000.0,
+            histogram_percentile(histogram, 0.9) / 1000.0,
+            histogram_percentile(histogram, 0.99) / 1000.0, histogram->max / 1000.0);
+}
+
+/* Writes metrics as "[SERVER] " lines for the text protocol.
+ */
+void metrics_write_text(Metrics *metrics, FILE *stream){
+    long *counters = metrics->counters;
+    long *gauges = metrics->gauges;
+    fprintf(stream, "[SERVER] clients %ld, jobs %ld, queued runs %ld\r\n",
+            gauges[GAUGE_CLIENTS], gauges[GAUGE_JOBS], gauges[GAUGE_QUEUED_RUNS]);
+    fprintf(stream, "[SERVER] connections accepted %ld, rejected %ld\r\n",
+            counters[MET_ACCEPTS], counters[MET_REJECTS]);
+    fprintf(stream, "[SERVER] bytes relayed from stdout %ld, stderr %ld\r\n",
+            counters[MET_STDOUT_BYTES], counters[MET_STDERR_BYTES]);
+    fprintf(stream, "[SERVER] commands:");
+    for(int i = 0; i < N_JOB_COMMANDS; i++){
+        fprintf(stream, " %s %ld,", job_command_names[i], metrics->commands[i]);
+    }
+    fprintf(stream, " invalid %ld\r\n", metrics->commands[N_JOB_COMMANDS]);
+    write_histogram_text(stream, "command latency", &(metrics->command_latency));
+    fprintf(stream, "[SERVER] event loop iterations %ld\r\n", counters[MET_LOOP_ITERATIONS]);
+    write_histogram_text(stream, "event loop busy time", &(metrics->loop_busy));
+}
+
+static void write_prometheus_header(FILE *stream, const char *name, const char *type,
+                                    const char *help){
+    fprintf(stream, "# HELP jobserver_%s %s\n# TYPE jobserver_%s %s\n", name, help, name, type);
+}
+
+/* Writes a histogram of nanoseconds as one in seconds, with a bucket for
+ * each power of two from PROM_MIN_BITS.
+ */
+static void write_histogram_prometheus(FILE *stream, const char *name, const char *help,
+                                       Histogram *histogram){
+    write_prometheus_header(stream, name, "histogram", help);
+    long below = 0;
+    int next = 0;
+    for(int bits = PROM_MIN_BITS; bits <= HIST_MAX_BITS; bits++){
+        int end = bucket_index(1L << bits);
+        for(; next < end; next++){
+            below += histogram->counts[next];
+        }
+        fprintf(stream, "jobserver_%s_bucket{le=\"%g\"} %ld\n", name, (1L << bits) / 1e9, below);
+    }
+    fprintf(stream, "jobserver_%s_bucket{le=\"+Inf\"} %ld\n", name, histogram->count);
+    fprintf(stream, "jobserver_%s_sum %.9f\n", name, histogram->sum / 1e9);
+    fprintf(stream, "jobserver_%s_count %ld\n", name, histogram->count);
+}
+
+/* Writes metrics in the Prometheus text exposition format.
+ */
+void metrics_write_prometheus(Metrics *metrics, FILE *stream){
+    long *counters = metrics->counters;
+    long *gauges = metrics->gauges;
+    write_prometheus_header(stream, "clients", "gauge", "Connected clients.");
+    fprintf(stream, "jobserver_clients %ld\n", gauges[GAUGE_CLIENTS]);
+    write_prometheus_header(stream, "jobs", "gauge", "Jobs in the job table.");
+    fprintf(stream, "jobserver_jobs %ld\n", gauges[GAUGE_JOBS]);
+    write_prometheus_header(stream, "queued_runs", "gauge", "Run requests waiting for a job slot.");
+    fprintf(stream, "jobserver_queued_runs %ld\n", gauges[GAUGE_QUEUED_RUNS]);
+
+    write_prometheus_header(stream, "accepts_total", "counter", "Connections accepted.");
+    fprintf(stream, "jobserver_accepts_total %ld\n", counters[MET_ACCEPTS]);
+    write_prometheus_header(stream, "rejects_total", "counter",
+                            "Connections closed on accept, over MAX_CLIENTS or out of memory.");
+    fprintf(stream, "jobserver_rejects_total %ld\n", counters[MET_REJECTS]);
+    write_prometheus_header(stream, "relayed_bytes_total", "counter", "Bytes read from job output.");
+    fprintf(stream, "jobserver_relayed_bytes_total{stream=\"stdout\"} %ld\n", counters[MET_STDOUT_BYTES]);
+    fprintf(stream, "jobserver_relayed_bytes_total{stream=\"stderr\"} %ld\n", counters[MET_STDERR_BYTES]);
+    write_prometheus_header(stream, "commands_total", "counter", "Commands received, by command.");
+    for(int i = 0; i < N_JOB_COMMANDS; i++){
+        fprintf(stream, "jobserver_commands_total{command=\"%s\"} %ld\n", job_command_names[i],
+                metrics->commands[i]);
+    }
+    fprintf(stream, "jobserver_commands_total{command=\"invalid\"} %ld\n",
+            metrics->commands[N_JOB_COMMANDS]);
+    write_histogram_prometheus(stream, "command_latency_seconds", "Time spent handling a command.",
+                               &(metrics->command_latency));
+    write_prometheus_header(stream, "loop_iterations_total", "counter", "Event loop iterations.");
+    fprintf(stream, "jobserver_loop_iterations_total %ld\n", counters[MET_LOOP_ITERATIONS]);
+    write_histogram_prometheus(stream, "loop_busy_seconds",
+                               "Time spent handling the events of an event loop iteration.",
+                               &(metrics->loop_busy));
+}
@@ -0,0 +1,85 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdio.h>
+
+#include "jobprotocol.h"
+
+// Histograms keep 1 << HIST_SUB_BITS buckets per power of two, so a value
+// is known to within 1 / (1 << HIST_SUB_BITS) of itself, and hold values
+// of up to 1 << HIST_MAX_BITS nanoseconds (about 68 seconds).
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 36
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef enum {MET_ACCEPTS, MET_REJECTS, MET_LOOP_ITERATIONS, MET_STDOUT_BYTES,
+              MET_STDERR_BYTES, NUM_COUNTERS} Counter;
+
+// Sampled when metrics are reported rather than counted
+typedef enum {GAUGE_CLIENTS, GAUGE_JOBS, GAUGE_QUEUED_RUNS, NUM_GAUGES} Gauge;
+
+/* Counts of values, in nanoseconds, with an HDR-style bucket layout:
+ * exact below HIST_SUB, then HIST_SUB evenly spaced buckets per power of
+ * two.
+ */
+struct histogram {
+        long counts[HIST_BUCKETS];
+        long count;
+        long sum;
+        long max;
+};
+typedef struct histogram Histogram;
+
+/* The counters and histograms of one reactor. A Metrics is only updated by
+ * the thread of its reactor, so updates are plain relaxed loads and stores
+ * with no locked instructions, and any thread may read it at any time.
+ * Commands are counted by JobCommand, with those that are not one last.
+ */
+struct metrics {
+        long counters[NUM_COUNTERS];
+        long commands[N_JOB_COMMANDS + 1];
+        long gauges[NUM_GAUGES];        // only set in totals being reported
+        Histogram loop_busy;            // time spent handling each batch of events
+        Histogram command_latency;      // time spent handling each command
+} __attribute__((aligned(64)));
+typedef struct metrics Metrics;
+
+/* Adds n to a counter owned by the calling thread.
+ */
+static inline void metric_add(long *counter, long n){
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+/* Returns the time of the monotonic clock in nanoseconds.
+ */
+long metrics_now(void);
+
+/* Records a value in a histogram owned by the calling thread.
+ */
+void histogram_record(Histogram *, long);
+
+/* Returns the value below which the given fraction of a histogram's values
+ * fall, as the highest value of the bucket it is found in. Returns 0 for an
+ * empty histogram.
+ */
+long histogram_percentile(Histogram *, double);
+
+/* Counts a command and records how long it took since start, from
+ * metrics_now.
+ */
+void metrics_command(Metrics *, int, long);
+
+/* Adds a snapshot of metrics, which may be updated meanwhile, to total.
+ */
+void metrics_sum(Metrics *total, Metrics *metrics);
+
+/* Writes metrics as "[SERVER] " lines for the text protocol.
+ */
+void metrics_write_text(Metrics *, FILE *);
+
+/* Writes metrics in the Prometheus text exposition format.
+ */
+void metrics_write_prometheus(Metrics *, FILE *);
+
+#endif
@@ -0,0 +1,227 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+
+#include "outqueue.h"
+
+#define OUTQ_INITIAL_CAPACITY 8
+
+/* Allocates a chunk with room for size bytes and a refcount of 1.
+ * Returns NULL if it could not be allocated.
+ */
+Chunk *chunk_new(int size){
+    Chunk *chunk = malloc(sizeof(struct msg_chunk) + size);
+    if(chunk == NULL){
+        perror("malloc chunk");
+        return NULL;
+    }
+    chunk->refcount = 1;
+    chunk->len = 0;
+    chunk->reserved = 0;
+    return chunk;
+}
+
+/* Allocates a chunk holding the formatted string, without its null
+ * terminator. Returns NULL on error.
+ */
+Chunk *chunk_printf(const char *format, ...){
+    va_list args;
+    va_start(args, format);
+    Chunk *chunk = chunk_vprintf(format, args);
+    va_end(args);
+    return chunk;
+}
+
+/* Same as chunk_printf, with a va_list.
+ */
+Chunk *chunk_vprintf(const char *format, va_list args){
+    va_list copy;
+    va_copy(copy, args);
+    int len = vsnprintf(NULL, 0, format, copy);
+    va_end(copy);
+    if(len < 0){
+        return NULL;
+    }
+    Chunk *chunk = chunk_new(len + 1);
+    if(chunk == NULL){
+        return NULL;
+    }
+    vsnprintf(chunk->data, len + 1, format, args);
+    chunk->len = len;
+    return chunk;
+}
+
+/* Takes another reference to the chunk.
+ */
+void chunk_ref(Chunk *chunk){
+    __atomic_add_fetch(&(chunk->refcount), 1, __ATOMIC_RELAXED);
+}
+
+/* Drops a reference to the chunk, freeing it with the last one.
+ */
+void chunk_unref(Chunk *chunk){
+    // A chunk can be queued to clients of several reactor threads
+    if(__atomic_sub_fetch(&(chunk->refcount), 1, __ATOMIC_ACQ_REL) == 0){
+        free(chunk);
+    }
+}
+
+/* Initializes an empty queue.
+ */
+void outq_init(OutQueue *queue){
+    queue->chunks = NULL;
+    queue->head = 0;
+    queue->count = 0;
+    queue->capacity = 0;
+    queue->offset = 0;
+    queue->bytes = 0;
+}
+
+/* Doubles the capacity of the queue, unrolling it to start at index 0.
+ * Returns 0 on success, -1 on error.
+ */
+static int outq_grow(OutQueue *queue){
+    int capacity = queue->capacity == 0 ? OUTQ_INITIAL_CAPACITY : queue->capacity * 2;
+    Chunk **chunks = malloc(capacity * sizeof(Chunk *));
+    if(chunks == NULL){
+        perror("malloc out queue");
+        return -1;
+    }
+    for(int i = 0; i < queue->count; i++){
+        chunks[i] = queue->chunks[(queue->head + i) % queue->capacity];
+    }
+    free(queue->chunks);
+    queue->chunks = chunks;
+    queue->head = 0;
+    queue->capacity = capacity;
+    return 0;
+}
+
+/* Appends a chunk to the queue, taking a new reference to it.
+ * Returns 0 on success, -1 if the queue could not grow.
+ */
+int outq_push(OutQueue *queue, Chunk *chunk){
+    if(queue->count == queue->capacity && outq_grow(queue) == -1){
+        return -1;
+    }
+    chunk_ref(chunk);
+    queue->chunks[(queue->head + queue->count) % queue->capacity] = chunk;
+    queue->count++;
+    queue->bytes += chunk->len;
+    return 0;
+}
+
+/* Appends a slot to the queue for a chunk that is not known yet. Nothing
+ * after the slot is written until it is filled with outq_fill.
+ * Returns the slot, with a reference for the caller, or NULL on error.
+ */
+Chunk *outq_reserve(OutQueue *queue){
+    Chunk *slot = chunk_new(0);
+    if(slot == NULL){
+        return NULL;
+    }
+    slot->reserved = 1;
+    if(outq_push(queue, slot) == -1){
+        chunk_unref(slot);
+        return NULL;
+    }
+    return slot;
+}
+
+/* Fills a slot reserved in the queue with chunk, taking a new reference to
+ * it, or with nothing if chunk is NULL, and drops the caller's reference
+ * to the slot.
+ */
+void outq_fill(OutQueue *queue, Chunk *slot, Chunk *chunk){
+    for(int i = 0; i < queue->count; i++){
+        int index = (queue->head + i) % queue->capacity;
+        if(queue->chunks[index] == slot){
+            // An empty slot is left in place and written as nothing
+            if(chunk != NULL){
+                chunk_ref(chunk);
+                queue->chunks[index] = chunk;
+                queue->bytes += chunk->len;
+                chunk_unref(slot);
+            }
+            break;
+        }
+    }
+    slot->reserved = 0;
+    chunk_unref(slot);
+}
+
+/* Returns the chunk i places from the front of the queue.
+ */
+static Chunk *outq_at(OutQueue *queue, int i){
+    return queue->chunks[(queue->head + i) % queue->capacity];
+}
+
+/* Removes the first chunk from the queue.
+ */
+static void outq_pop(OutQueue *queue){
+    chunk_unref(queue->chunks[queue->head]);
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    queue->offset = 0;
+}
+
+/* Writes as much of the queue to the socket fd as possible, up to
+ * OUTQ_IOV_MAX chunks per sendmsg and no further than a slot yet to be
+ * filled. Every batch but the last is sent with MSG_MORE, so the kernel
+ * can fill whole segments across batches without holding back the end of
+ * what can be written.
+ * Returns 0 if the queue is now empty, 1 if fd would block or a reserved
+ * slot holds back the rest of the queue, or -1 on error.
+ */
+int outq_flush(OutQueue *queue, int fd){
+    struct iovec iov[OUTQ_IOV_MAX];
+    while(queue->count > 0){
+        int n = 0;
+        while(n < queue->count && n < OUTQ_IOV_MAX && !outq_at(queue, n)->reserved){
+            iov[n].iov_base = outq_at(queue, n)->data;
+            iov[n].iov_len = outq_at(queue, n)->len;
+            n++;
+        }
+        if(n == 0){
+            return 1;
+        }
+        iov[0].iov_base = (char *)iov[0].iov_base + queue->offset;
+        iov[0].iov_len -= queue->offset;
+
+        int more = n < queue->count && !outq_at(queue, n)->reserved;
+        struct msghdr header = {.msg_iov = iov, .msg_iovlen = n};
+        ssize_t written = sendmsg(fd, &header, more ? MSG_MORE : 0);
+        if(written == -1){
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                return 1;
+            }
+            if(errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        queue->bytes -= written;
+        for(int i = 0; i < n; i++){
+            if((size_t)written < iov[i].iov_len){
+                queue->offset += written;
+                break;
+            }
+            written -= iov[i].iov_len;
+            outq_pop(queue);
+        }
+    }
+    return 0;
+}
+
+/* Drops every queued chunk and frees the queue's memory.
+ */
+void outq_clear(OutQueue *queue){
+    while(queue->count > 0){
+        outq_pop(queue);
+    }
+    free(queue->chunks);
+    outq_init(queue);
+}
@@ -0,0 +1,90 @@
+#ifndef _OUTQUEUE_H_
+#define _OUTQUEUE_H_
+
+#include <stddef.h>
+#include <stdarg.h>
+
+// Most chunks handed to a single writev call
+#define OUTQ_IOV_MAX 64
+
+/* A reference counted block of bytes to send. A message is formatted into
+ * a chunk once, and the same chunk is queued to every client receiving it.
+ */
+struct msg_chunk {
+        int refcount;
+        int len;
+        int reserved;   // a slot in a queue waiting for outq_fill
+        char data[];
+};
+typedef struct msg_chunk Chunk;
+
+/* Chunks waiting to be written to one fd, in a circular array.
+ */
+struct out_queue {
+        struct msg_chunk **chunks;
+        int head;
+        int count;
+        int capacity;
+        int offset;     // bytes of the first chunk already written
+        size_t bytes;   // bytes queued and not yet written
+};
+typedef struct out_queue OutQueue;
+
+/* Allocates a chunk with room for size bytes and a refcount of 1.
+ * Returns NULL if it could not be allocated.
+ */
+Chunk *chunk_new(int);
+
+/* Allocates a chunk holding the formatted string, without its null
+ * terminator. Returns NULL on error.
+ */
+Chunk *chunk_printf(const char *, ...) __attribute__((format(printf, 1, 2)));
+
+/* Same as chunk_printf, with a va_list.
+ */
+Chunk *chunk_vprintf(const char *, va_list);
+
+/* Takes another reference to the chunk.
+ */
+void chunk_ref(Chunk *);
+
+/* Drops a reference to the chunk, freeing it with the last one.
+ */
+void chunk_unref(Chunk *);
+
+/* Initializes an empty queue.
+ */
+void outq_init(OutQueue *);
+
+/* Appends a chunk to the queue, taking a new reference to it.
+ * Returns 0 on success, -1 if the queue could not grow.
+ */
+int outq_push(OutQueue *, Chunk *);
+
+/* Appends a slot to the queue for a chunk that is not known yet. Nothing
+ * after the slot is written until it is filled with outq_fill.
+ * Returns the slot, with a reference for the caller, or NULL on error.
+ */
+Chunk *outq_reserve(OutQueue *);
+
+/* Fills a slot reserved in the queue with chunk, taking a new reference to
+ * it, or with nothing if chunk is NULL, and drops the caller's reference
+ * to the slot.
+ */
+void outq_fill(OutQueue *, Chunk *slot, Chunk *chunk);
+
+/* Writes as much of the queue to the socket fd as possible, up to
+ * OUTQ_IOV_MAX chunks per sendmsg and no further than a slot yet to be
+ * filled. Every batch but the last is sent with MSG_MORE, so the kernel
+ * can fill whole segments across batches without holding back the end of
+ * what can be written.
+ * Returns 0 if the queue is now empty, 1 if fd would block or a reserved
+ * slot holds back the rest of the queue, or -1 on error.
+ */
+int outq_flush(OutQueue *, int);
+
+/* Drops every queued chunk and frees the queue's memory.
+ */
+void outq_clear(OutQueue *);
+
+#endif
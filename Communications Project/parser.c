@@ -0,0 +1,90 @@
+#include <string.h>
+
+#include "parser.h"
+
+// Fewest and most words that may follow each command's name
+struct arg_limits {
+        int min;
+        int max;
+};
+
+#define JOB_COMMAND_LIMITS(command, name, min_args, max_args) [command] = {min_args, max_args},
+static const struct arg_limits arg_limits[N_JOB_COMMANDS] = {JOB_COMMANDS(JOB_COMMAND_LIMITS)};
+
+/* Returns the number of words separated by spaces in the null-terminated
+ * line. The words given to parse_command must have room for one more.
+ */
+int count_words(const char *line){
+    int num_words = 0;
+    const char *p = line;
+    while(1){
+        while(*p == ' '){
+            p++;
+        }
+        if(*p == '\0'){
+            return num_words;
+        }
+        num_words++;
+        while(*p != ' ' && *p != '\0'){
+            p++;
+        }
+    }
+}
+
+/* Splits the null-terminated line into words separated by spaces, in
+ * place and without copying, into words, and looks up the command it
+ * names. words must have room for count_words(line) + 1 pointers.
+ * Returns 1 if it is a command followed by as many words as JOB_COMMANDS
+ * allows, 0 if the line is blank, or -1 otherwise. The line must be put
+ * back with restore_command whatever is returned.
+ */
+int parse_command(char *line, CommandLine *cmd, char **words){
+    int num_words = 0;
+    cmd->words = words;
+    cmd->command = CMD_INVALID;
+    cmd->argc = -1;
+    cmd->end = line;
+    char *p = line;
+    while(1){
+        while(*p == ' '){
+            p++;
+        }
+        if(*p == '\0'){
+            break;
+        }
+        cmd->words[num_words++] = p;
+        while(*p != ' ' && *p != '\0'){
+            p++;
+        }
+        if(*p == ' '){
+            *p++ = '\0';
+        }
+        cmd->end = p;
+    }
+    cmd->words[num_words] = NULL;
+    if(num_words == 0){
+        return 0;
+    }
+    cmd->command = find_job_command(cmd->words[0], strlen(cmd->words[0]));
+    cmd->argc = num_words - 1;
+    if(cmd->command == CMD_INVALID || cmd->argc < arg_limits[cmd->command].min ||
+       cmd->argc > arg_limits[cmd->command].max){
+        return -1;
+    }
+    return 1;
+}
+
+/* Puts back the spaces parse_command overwrote, leaving the line as it
+ * was. The line has no null bytes before its end but those written by
+ * parse_command.
+ */
+void restore_command(CommandLine *cmd){
+    if(cmd->words[0] == NULL){
+        return;
+    }
+    for(char *p = cmd->words[0]; p < cmd->end; p++){
+        if(*p == '\0'){
+            *p = ' ';
+        }
+    }
+}
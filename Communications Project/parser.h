@@ -0,0 +1,38 @@
+#ifndef _PARSER_H_
+#define _PARSER_H_
+
+#include "jobprotocol.h"
+
+/* A text command split into words in place. The space after each word
+ * but the last is overwritten with a null byte, so words is an argv of
+ * slices of the line itself, which restore_command puts back as it was.
+ * words is provided by the caller, sized with count_words.
+ */
+struct command_line {
+        JobCommand command;             // CMD_INVALID if the name is unknown
+        int argc;                       // words after the name
+        char *end;                      // just past the last null byte written
+        char **words;                   // the name first, then NULL-terminated
+};
+typedef struct command_line CommandLine;
+
+/* Returns the number of words separated by spaces in the null-terminated
+ * line. The words given to parse_command must have room for one more.
+ */
+int count_words(const char *);
+
+/* Splits the null-terminated line into words separated by spaces, in
+ * place and without copying, into words, and looks up the command it
+ * names.
+ * Returns 1 if it is a command followed by as many words as JOB_COMMANDS
+ * allows, 0 if the line is blank, or -1 otherwise. The line must be put
+ * back with restore_command whatever is returned.
+ */
+int parse_command(char *, CommandLine *, char **);
+
+/* Puts back the spaces parse_command overwrote, leaving the line as it
+ * was.
+ */
+void restore_command(CommandLine *);
+
+#endif
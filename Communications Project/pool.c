@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+// Freed objects stay poisoned under AddressSanitizer, so a use after
+// pool_free is still reported even though the memory is never released.
+#if defined(__SANITIZE_ADDRESS__)
+    #include <sanitizer/asan_interface.h>
+    #define POISON(addr, size) ASAN_POISON_MEMORY_REGION((addr), (size))
+    #define UNPOISON(addr, size) ASAN_UNPOISON_MEMORY_REGION((addr), (size))
+#else
+    #define POISON(addr, size) ((void)(addr), (void)(size))
+    #define UNPOISON(addr, size) ((void)(addr), (void)(size))
+#endif
+
+/* Allocates a slab and puts all of its objects on the free list. The
+ * first POOL_ALIGN bytes of a slab link it to the previous one.
+ * The pool must be locked. Returns 0 on success, -1 on error.
+ */
+static int pool_grow(Pool *pool){
+    void *slab;
+    int result = posix_memalign(&slab, POOL_ALIGN, POOL_ALIGN + pool->per_slab * pool->size);
+    if(result != 0){
+        fprintf(stderr, "posix_memalign %s pool: %s\n", pool->name, strerror(result));
+        return -1;
+    }
+    *(void **)slab = pool->slabs;
+    pool->slabs = slab;
+    pool->stats.slabs++;
+
+    // Pushed in reverse, so objects are handed out in address order
+    char *objects = (char *)slab + POOL_ALIGN;
+    for(int i = pool->per_slab - 1; i >= 0; i--){
+        void *object = objects + i * pool->size;
+        *(void **)object = pool->free_list;
+        pool->free_list = object;
+        POISON(object, pool->size);
+    }
+    return 0;
+}
+
+/* Returns an uninitialized object from the pool, aligned to POOL_ALIGN.
+ * Returns NULL if a new slab was needed and could not be allocated.
+ */
+void *pool_alloc(Pool *pool){
+    pthread_mutex_lock(&(pool->lock));
+    if(pool->free_list == NULL && pool_grow(pool) == -1){
+        pthread_mutex_unlock(&(pool->lock));
+        return NULL;
+    }
+    void *object = pool->free_list;
+    UNPOISON(object, pool->size);
+    pool->free_list = *(void **)object;
+    pool->stats.allocs++;
+    if(++pool->stats.in_use > pool->stats.high_water){
+        pool->stats.high_water = pool->stats.in_use;
+    }
+    pthread_mutex_unlock(&(pool->lock));
+    return object;
+}
+
+/* Returns an object allocated by pool_alloc to the pool.
+ */
+void pool_free(Pool *pool, void *object){
+    if(object == NULL){
+        return;
+    }
+    pthread_mutex_lock(&(pool->lock));
+    *(void **)object = pool->free_list;
+    pool->free_list = object;
+    POISON(object, pool->size);
+    pool->stats.frees++;
+    pool->stats.in_use--;
+    pthread_mutex_unlock(&(pool->lock));
+}
+
+/* Copies the pool's counters into stats.
+ */
+void pool_get_stats(Pool *pool, PoolStats *stats){
+    pthread_mutex_lock(&(pool->lock));
+    *stats = pool->stats;
+    pthread_mutex_unlock(&(pool->lock));
+}
+
+/* Prints a line of the pool's counters to stream.
+ */
+void pool_print_stats(Pool *pool, FILE *stream){
+    PoolStats stats;
+    pool_get_stats(pool, &stats);
+    fprintf(stream, "pool %s: %zu bytes, %ld slabs, %ld in use, %ld high water, "
+            "%ld allocs, %ld frees\n", pool->name, pool->size, stats.slabs,
+            stats.in_use, stats.high_water, stats.allocs, stats.frees);
+}
+
+/* Frees every slab of the pool. No object from it may be used afterwards.
+ */
+void pool_destroy(Pool *pool){
+    pthread_mutex_lock(&(pool->lock));
+    while(pool->slabs != NULL){
+        void *slab = pool->slabs;
+        pool->slabs = *(void **)slab;
+        UNPOISON(slab, POOL_ALIGN + pool->per_slab * pool->size);
+        free(slab);
+    }
+    pool->free_list = NULL;
+    pool->stats.slabs = 0;
+    pthread_mutex_unlock(&(pool->lock));
+}
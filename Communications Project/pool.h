@@ -0,0 +1,65 @@
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include <stddef.h>
+#include <stdio.h>
+#include <pthread.h>
+
+// Objects handed out by a pool start on their own cache line
+#define POOL_ALIGN 64
+
+/* Counters kept by every pool.
+ */
+struct pool_stats {
+        long slabs;             // slabs allocated from the heap
+        long in_use;            // objects currently allocated
+        long high_water;        // most objects ever in use at once
+        long allocs;            // calls to pool_alloc that succeeded
+        long frees;
+};
+typedef struct pool_stats PoolStats;
+
+/* A fixed size object allocator. Objects are carved out of slabs of
+ * per_slab objects and kept on a free list once freed, so after a pool
+ * has grown to its working set, allocating and freeing never reaches the
+ * heap. Slabs are only returned to the heap by pool_destroy.
+ */
+struct pool {
+        const char *name;
+        size_t size;            // object size, rounded up to POOL_ALIGN
+        int per_slab;
+        void *free_list;
+        void *slabs;            // most recently allocated slab
+        pthread_mutex_t lock;
+        struct pool_stats stats;
+};
+typedef struct pool Pool;
+
+/* Static initializer for a pool of objects of the given type.
+ */
+#define POOL_INITIALIZER(name, type, per_slab) \
+    {(name), (sizeof(type) + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1), \
+     (per_slab), NULL, NULL, PTHREAD_MUTEX_INITIALIZER, {0, 0, 0, 0, 0}}
+
+/* Returns an uninitialized object from the pool, aligned to POOL_ALIGN.
+ * Returns NULL if a new slab was needed and could not be allocated.
+ */
+void *pool_alloc(Pool *);
+
+/* Returns an object allocated by pool_alloc to the pool.
+ */
+void pool_free(Pool *, void *);
+
+/* Copies the pool's counters into stats.
+ */
+void pool_get_stats(Pool *, PoolStats *);
+
+/* Prints a line of the pool's counters to stream.
+ */
+void pool_print_stats(Pool *, FILE *);
+
+/* Frees every slab of the pool. No object from it may be used afterwards.
+ */
+void pool_destroy(Pool *);
+
+#endif
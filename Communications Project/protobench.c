@@ -0,0 +1,347 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include "jobprotocol.h"
+#include "parser.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <x86intrin.h>
+#endif
+
+/* Microbenchmarks for the text primitives of jobprotocol.c and parser.c,
+ * over corpora modelled on real traffic: short CRLF client commands, the
+ * 500+ byte line of jobs/longprint and the 3 to 7 byte fragments of
+ * jobs/randprint.
+ * Each benchmark reports ns/byte of input and cycles per call. Cycles are
+ * read from the TSC where there is one, and estimated from the clock
+ * otherwise.
+ */
+
+// Passes over each corpus; more gives steadier numbers
+#ifndef BENCH_ITERATIONS
+    #define BENCH_ITERATIONS 20000
+#endif
+
+// jobs/longprint's single line
+#define LONGPRINT_LINE "1: The quick brown fox jumps over the lazy dog. " \
+    "2: The quick brown fox jumps over the lazy dog. 3: The quick brown fox " \
+    "jumps over the lazy dog. 4: The quick brown fox jumps over the lazy dog. " \
+    "5: The quick brown fox jumps over the lazy dog. 6: The quick brown fox " \
+    "jumps over the lazy dog.\n"
+
+// jobs/randprint's message and piece sizes
+#define RANDPRINT_MESSAGE "A stitch in time\r\n"
+#define RANDPRINT_MINCHARS 3
+#define RANDPRINT_MAXCHARS 7
+#define RANDPRINT_REPEATS 64
+
+const char *commands[] = {
+    "jobs\r\n",
+    "run fastjob\r\n",
+    "run randprint 10\r\n",
+    "watch 48213\r\n",
+    "kill 48213\r\n",
+    "run slowjob\r\n",
+    "watch 48214\r\n",
+    "jobs\r\n",
+};
+#define NUM_COMMANDS (sizeof(commands) / sizeof(commands[0]))
+
+/* A set of inputs that one primitive is called on, once per piece.
+ */
+struct corpus {
+        const char *name;
+        char *data;
+        char *original;         // copy of data, to undo in place edits
+        int *lens;              // length of each piece, in order
+        int num_pieces;
+        int bytes;
+};
+typedef struct corpus Corpus;
+
+// Keeps results alive so the calls are not optimized away
+volatile long sink;
+
+double cycles_per_ns;
+
+/* Returns the time of the monotonic clock in nanoseconds.
+ */
+long long now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Returns the current cycle count, or nanoseconds without a TSC, in which
+ * case the cycles/call column is in nanoseconds too.
+ */
+static inline unsigned long long cycles(void){
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return now_ns();
+#endif
+}
+
+/* Measures how many cycles() ticks pass per nanosecond.
+ */
+void calibrate(void){
+    long long start_ns = now_ns();
+    unsigned long long start = cycles();
+    struct timespec pause = {0, 50000000};
+    nanosleep(&pause, NULL);
+    cycles_per_ns = (double)(cycles() - start) / (now_ns() - start_ns);
+}
+
+void add_piece(Corpus *corpus, const char *piece, int len){
+    corpus->data = realloc(corpus->data, corpus->bytes + len + 1);
+    corpus->lens = realloc(corpus->lens, (corpus->num_pieces + 1) * sizeof(int));
+    if(corpus->data == NULL || corpus->lens == NULL){
+        perror("realloc");
+        exit(1);
+    }
+    memcpy(corpus->data + corpus->bytes, piece, len);
+    corpus->lens[corpus->num_pieces++] = len;
+    corpus->bytes += len;
+    // Room for the byte convert_to_crlf looks at past the end
+    corpus->data[corpus->bytes] = '\0';
+    corpus->original = realloc(corpus->original, corpus->bytes + 1);
+    if(corpus->original == NULL){
+        perror("realloc");
+        exit(1);
+    }
+    memcpy(corpus->original, corpus->data, corpus->bytes + 1);
+}
+
+void build_commands(Corpus *corpus){
+    corpus->name = "commands";
+    for(int i = 0; i < NUM_COMMANDS; i++){
+        add_piece(corpus, commands[i], strlen(commands[i]));
+    }
+}
+
+void build_longprint(Corpus *corpus){
+    corpus->name = "longprint";
+    add_piece(corpus, LONGPRINT_LINE, strlen(LONGPRINT_LINE));
+}
+
+/* Splits repeats of randprint's message into pieces the way randprint
+ * writes them.
+ */
+void build_randprint(Corpus *corpus){
+    corpus->name = "randprint";
+    int message_len = strlen(RANDPRINT_MESSAGE);
+    int total = RANDPRINT_REPEATS * message_len;
+    char piece[RANDPRINT_MAXCHARS];
+    srand(0);
+    for(int current = 0; current < total;){
+        int size = rand() % (RANDPRINT_MAXCHARS - RANDPRINT_MINCHARS + 1) + RANDPRINT_MINCHARS;
+        if(size > total - current){
+            size = total - current;
+        }
+        for(int i = 0; i < size; i++){
+            piece[i] = RANDPRINT_MESSAGE[(current + i) % message_len];
+        }
+        add_piece(corpus, piece, size);
+        current += size;
+    }
+}
+
+/* Prints one result. elapsed is in cycles() ticks.
+ */
+void report(const char *function, Corpus *corpus, long long calls,
+            long long bytes, unsigned long long elapsed){
+    double ns = elapsed / cycles_per_ns;
+    printf("%-22s %-10s %12lld %10.3f %12.1f\n", function, corpus->name, calls,
+           ns / bytes, (double)elapsed / calls);
+}
+
+typedef int (*SearchFunc)(const char *, int);
+
+/* Calls a newline search on every piece of the corpus.
+ */
+void bench_search(const char *function, SearchFunc search, Corpus *corpus){
+    long result = 0;
+    unsigned long long start = cycles();
+    for(int iter = 0; iter < BENCH_ITERATIONS; iter++){
+        const char *piece = corpus->data;
+        for(int i = 0; i < corpus->num_pieces; i++){
+            result += search(piece, corpus->lens[i]);
+            piece += corpus->lens[i];
+        }
+    }
+    unsigned long long elapsed = cycles() - start;
+    sink = result;
+    report(function, corpus, (long long)BENCH_ITERATIONS * corpus->num_pieces,
+           (long long)BENCH_ITERATIONS * corpus->bytes, elapsed);
+}
+
+/* Calls remove_newline on every piece, putting the newline back after
+ * each call. The piece is only modified at the newline.
+ */
+void bench_remove_newline(Corpus *corpus){
+    long result = 0;
+    unsigned long long start = cycles();
+    for(int iter = 0; iter < BENCH_ITERATIONS; iter++){
+        int offset = 0;
+        for(int i = 0; i < corpus->num_pieces; i++){
+            int index = remove_newline(corpus->data + offset, corpus->lens[i]);
+            if(index >= 0){
+                corpus->data[offset + index] = corpus->original[offset + index];
+            }
+            result += index;
+            offset += corpus->lens[i];
+        }
+    }
+    unsigned long long elapsed = cycles() - start;
+    sink = result;
+    report("remove_newline", corpus, (long long)BENCH_ITERATIONS * corpus->num_pieces,
+           (long long)BENCH_ITERATIONS * corpus->bytes, elapsed);
+}
+
+/* Calls convert_to_crlf on every piece, putting the newline back after
+ * each call.
+ */
+void bench_convert_to_crlf(Corpus *corpus){
+    long result = 0;
+    unsigned long long start = cycles();
+    for(int iter = 0; iter < BENCH_ITERATIONS; iter++){
+        int offset = 0;
+        for(int i = 0; i < corpus->num_pieces; i++){
+            int index = convert_to_crlf(corpus->data + offset, corpus->lens[i]);
+            if(index >= 0){
+                memcpy(corpus->data + offset + index - 2, corpus->original + offset + index - 2, 2);
+            }
+            result += index;
+            offset += corpus->lens[i];
+        }
+    }
+    unsigned long long elapsed = cycles() - start;
+    sink = result;
+    report("convert_to_crlf", corpus, (long long)BENCH_ITERATIONS * corpus->num_pieces,
+           (long long)BENCH_ITERATIONS * corpus->bytes, elapsed);
+}
+
+/* Calls count_words, parse_command and restore_command on every client
+ * command, without its network newline, as the server handles them.
+ */
+void bench_parse_command(Corpus *corpus){
+    char lines[NUM_COMMANDS][64];
+    for(int i = 0; i < NUM_COMMANDS; i++){
+        int len = strlen(commands[i]) - 2;
+        memcpy(lines[i], commands[i], len);
+        lines[i][len] = '\0';
+    }
+    CommandLine cmd;
+    long result = 0;
+    unsigned long long start = cycles();
+    for(int iter = 0; iter < BENCH_ITERATIONS; iter++){
+        for(int i = 0; i < NUM_COMMANDS; i++){
+            char *words[count_words(lines[i]) + 1];
+            result += parse_command(lines[i], &cmd, words) + cmd.command + cmd.argc;
+            restore_command(&cmd);
+        }
+    }
+    unsigned long long elapsed = cycles() - start;
+    sink = result;
+    report("parse_command", corpus, (long long)BENCH_ITERATIONS * NUM_COMMANDS,
+           (long long)BENCH_ITERATIONS * corpus->bytes, elapsed);
+}
+
+/* Feeds every piece through a pipe into read_to_buf and frames it with
+ * get_next_msg, as the server does with client and job output. Only the
+ * read and the framing are timed, not the write into the pipe. Lines
+ * longer than BUF_MAX are dropped like the server drops them.
+ */
+void bench_read_to_buf(Corpus *corpus, NewlineType newline){
+    int fds[2];
+    if(pipe(fds) == -1){
+        perror("pipe");
+        exit(1);
+    }
+    Buffer buffer;
+    init_buffer(&buffer);
+    long result = 0;
+    long long calls = 0;
+    unsigned long long elapsed = 0;
+    // Fewer passes: every piece also costs a write system call
+    int iterations = BENCH_ITERATIONS / 10;
+    for(int iter = 0; iter < iterations; iter++){
+        const char *piece = corpus->data;
+        for(int i = 0; i < corpus->num_pieces; i++){
+            if(write(fds[1], piece, corpus->lens[i]) != corpus->lens[i]){
+                perror("write");
+                exit(1);
+            }
+            piece += corpus->lens[i];
+
+            unsigned long long start = cycles();
+            int pending = corpus->lens[i];
+            while(pending > 0){
+                int num_read = read_to_buf(fds[0], &buffer);
+                calls++;
+                if(num_read == -1 && errno == ENOBUFS){
+                    discard_line(&buffer);
+                    continue;
+                }
+                if(num_read <= 0){
+                    perror("read_to_buf");
+                    exit(1);
+                }
+                pending -= num_read;
+                int msg_len;
+                char *msg;
+                while((msg = get_next_msg(&buffer, &msg_len, newline)) != NULL){
+                    result += msg_len + msg[0];
+                }
+            }
+            elapsed += cycles() - start;
+        }
+    }
+    sink = result;
+    free_buffer(&buffer);
+    close(fds[0]);
+    close(fds[1]);
+    report("read_to_buf+framing", corpus, calls,
+           (long long)iterations * corpus->bytes, elapsed);
+}
+
+int main(void) {
+    setbuf(stdout, NULL);
+    calibrate();
+
+    Corpus corpora[3];
+    memset(corpora, 0, sizeof(corpora));
+    build_commands(&corpora[0]);
+    build_longprint(&corpora[1]);
+    build_randprint(&corpora[2]);
+
+    printf("%-22s %-10s %12s %10s %12s\n", "function", "corpus", "calls", "ns/byte", "cycles/call");
+    for(int i = 0; i < 3; i++){
+        bench_search("find_network_newline", find_network_newline, &corpora[i]);
+    }
+    for(int i = 0; i < 3; i++){
+        bench_search("find_unix_newline", find_unix_newline, &corpora[i]);
+    }
+    for(int i = 0; i < 3; i++){
+        bench_remove_newline(&corpora[i]);
+    }
+    for(int i = 0; i < 3; i++){
+        bench_convert_to_crlf(&corpora[i]);
+    }
+    bench_parse_command(&corpora[0]);
+    bench_read_to_buf(&corpora[0], NEWLINE_CRLF);
+    bench_read_to_buf(&corpora[1], NEWLINE_LF);
+    bench_read_to_buf(&corpora[2], NEWLINE_LF);
+
+    for(int i = 0; i < 3; i++){
+        free(corpora[i].data);
+        free(corpora[i].original);
+        free(corpora[i].lens);
+    }
+    return 0;
+}
@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+
+#include "reactor.h"
+
+/* Fills in an event source for fd, owned by owner.
+ */
+void event_source_init(EventSource *source, EventType type, int fd, void *owner){
+    source->type = type;
+    source->fd = fd;
+    source->owner = owner;
+}
+
+/* Creates a new epoll instance.
+ * Returns its fd, or -1 on error.
+ */
+int reactor_create(void){
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if(epoll_fd == -1){
+        perror("epoll_create1");
+    }
+    return epoll_fd;
+}
+
+/* Registers the source's fd with the given events.
+ * Returns 0 on success, -1 on error.
+ */
+int reactor_add(int epoll_fd, EventSource *source, uint32_t events){
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = source;
+    if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, source->fd, &ev) == -1){
+        perror("epoll_ctl add");
+        return -1;
+    }
+    return 0;
+}
+
+/* Changes the events the source's fd is registered for.
+ * Returns 0 on success, -1 on error.
+ */
+int reactor_modify(int epoll_fd, EventSource *source, uint32_t events){
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = source;
+    if(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, source->fd, &ev) == -1){
+        perror("epoll_ctl mod");
+        return -1;
+    }
+    return 0;
+}
+
+/* Stops watching the source's fd.
+ * Returns 0 on success, -1 on error.
+ */
+int reactor_remove(int epoll_fd, EventSource *source){
+    if(epoll_ctl(epoll_fd, EPOLL_CTL_DEL, source->fd, NULL) == -1){
+        perror("epoll_ctl del");
+        return -1;
+    }
+    return 0;
+}
+
+/* Puts fd in non-blocking mode, as required for edge-triggered events.
+ * Returns 0 on success, -1 on error.
+ */
+int set_nonblocking(int fd){
+    int flags = fcntl(fd, F_GETFL, 0);
+    if(flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1){
+        perror("fcntl O_NONBLOCK");
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,56 @@
+#ifndef _REACTOR_H_
+#define _REACTOR_H_
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+// Maximum number of ready events handled per call to epoll_wait
+#ifndef MAX_EVENTS
+    #define MAX_EVENTS 256
+#endif
+
+typedef enum {EV_LISTEN, EV_CLIENT, EV_JOB_STDOUT, EV_JOB_STDERR, EV_SIGCHLD,
+              EV_WAKEUP, EV_METRICS_LISTEN, EV_METRICS_CLIENT, EV_ZYGOTE,
+              EV_FLUSH_TIMER} EventType;
+
+/* Context registered with epoll for every fd the server waits on. The
+ * epoll data pointer refers to one of these, so a ready event leads
+ * straight to the Client or JobNode that owns the fd.
+ */
+struct event_source {
+        EventType type;
+        int fd;
+        void *owner;
+};
+typedef struct event_source EventSource;
+
+/* Fills in an event source for fd, owned by owner.
+ */
+void event_source_init(EventSource *, EventType, int, void *);
+
+/* Creates a new epoll instance.
+ * Returns its fd, or -1 on error.
+ */
+int reactor_create(void);
+
+/* Registers the source's fd with the given events.
+ * Returns 0 on success, -1 on error.
+ */
+int reactor_add(int, EventSource *, uint32_t);
+
+/* Changes the events the source's fd is registered for.
+ * Returns 0 on success, -1 on error.
+ */
+int reactor_modify(int, EventSource *, uint32_t);
+
+/* Stops watching the source's fd.
+ * Returns 0 on success, -1 on error.
+ */
+int reactor_remove(int, EventSource *);
+
+/* Puts fd in non-blocking mode, as required for edge-triggered events.
+ * Returns 0 on success, -1 on error.
+ */
+int set_nonblocking(int);
+
+#endif
@@ -1,9 +1,11 @@
+#define _GNU_SOURCE // accept4
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <arpa/inet.h>     /* inet_ntoa */
+#include <arpa/inet.h>
 #include <netdb.h>         /* gethostname */
+#include <netinet/tcp.h>   /* TCP_DEFER_ACCEPT */
 #include <sys/socket.h>
 
 #include "socket.h"
@@ -29,8 +31,13 @@ struct sockaddr_in *init_server_addr(int port) {
 
 /*
  * Create and setup a socket for a server to listen on.
+ * With reuse_port, several sockets can listen on the same port and the
+ * kernel spreads incoming connections across them. With defer_accept
+ * seconds, a connection is only reported once its first bytes arrive,
+ * or is dropped if none do in that time; 0 reports it at once.
  */
-int setup_server_socket(struct sockaddr_in *self, int num_queue) {
+int setup_server_socket(struct sockaddr_in *self, int num_queue, int reuse_port,
+                        int defer_accept) {
     int soc = socket(PF_INET, SOCK_STREAM, 0);
     if (soc < 0) {
         perror("socket");
@@ -46,6 +53,16 @@ int setup_server_socket(struct sockaddr_in *self, int num_queue) {
         perror("setsockopt");
         exit(1);
     }
+    if (reuse_port && setsockopt(soc, SOL_SOCKET, SO_REUSEPORT,
+        (const char *) &on, sizeof(on)) < 0) {
+        perror("setsockopt SO_REUSEPORT");
+        exit(1);
+    }
+    if (defer_accept > 0 && setsockopt(soc, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+        &defer_accept, sizeof(defer_accept)) < 0) {
+        perror("setsockopt TCP_DEFER_ACCEPT");
+        exit(1);
+    }
 
     // Associate the process with the address and a port
     if (bind(soc, (struct sockaddr *)self, sizeof(*self)) < 0) {
@@ -66,26 +83,16 @@ int setup_server_socket(struct sockaddr_in *self, int num_queue) {
 
 
 /*
- * Wait for and accept a new connection.
- * Return -1 if the accept call failed.
+ * Accept a pending connection without waiting, as a non-blocking,
+ * close-on-exec socket, and store its address in peer.
+ * Return -1 with errno set if the accept call failed, to EAGAIN if no
+ * connection is pending. Nothing is logged, so a listening socket can be
+ * drained in a loop.
  */
-int accept_connection(int listenfd) {
-    struct sockaddr_in peer;
-    unsigned int peer_len = sizeof(peer);
-    peer.sin_family = PF_INET;
-
-    fprintf(stderr, "Waiting for a new connection...\n");
-    int client_socket = accept(listenfd, (struct sockaddr *)&peer, &peer_len);
-    if (client_socket < 0) {
-        perror("accept");
-        return -1;
-    } else {
-        fprintf(stderr,
-            "New connection accepted from %s:%d\n",
-            inet_ntoa(peer.sin_addr),
-            ntohs(peer.sin_port));
-        return client_socket;
-    }
+int accept_connection(int listenfd, struct sockaddr_in *peer) {
+    socklen_t peer_len = sizeof(*peer);
+    return accept4(listenfd, (struct sockaddr *)peer, &peer_len,
+                   SOCK_NONBLOCK | SOCK_CLOEXEC);
 }
 
 
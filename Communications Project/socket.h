@@ -4,8 +4,9 @@
 #include <netinet/in.h>    /* Internet domain header, for struct sockaddr_in */
 
 struct sockaddr_in *init_server_addr(int port);
-int setup_server_socket(struct sockaddr_in *self, int num_queue);
-int accept_connection(int listenfd);
+int setup_server_socket(struct sockaddr_in *self, int num_queue, int reuse_port,
+                        int defer_accept);
+int accept_connection(int listenfd, struct sockaddr_in *peer);
 
 int connect_to_server(int port, const char *hostname);
 
@@ -0,0 +1,279 @@
+#define _GNU_SOURCE // pipe2, clone
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "zygote.h"
+
+/* Closes both ends of a pipe, ignoring ends that are already closed.
+ */
+static void close_pipe(int fds[2]){
+    if(fds[0] != -1){
+        close(fds[0]);
+    }
+    if(fds[1] != -1){
+        close(fds[1]);
+    }
+}
+
+// Stack the new job runs on until it execs
+#define EXEC_STACK_SIZE (256 * 1024)
+
+/* What a new job execs, shared with the zygote until it does.
+ */
+struct exec_args {
+        char *path;
+        char **args;
+        int out_fd;
+        int err_fd;
+        int error;              // set if the exec failed
+};
+typedef struct exec_args ExecArgs;
+
+/* Runs in the new job: points its stdout and stderr at the pipes and execs
+ * the program. If that fails, the reason is left in the zygote's memory,
+ * which the job shares until then.
+ */
+static int exec_job(void *arg){
+    ExecArgs *exec = arg;
+    // The zygote ignores SIGINT, which would carry over the exec, and a job
+    // gets SIGPIPE whatever the server was started with
+    signal(SIGINT, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+    if(dup2(exec->out_fd, STDOUT_FILENO) != -1 && dup2(exec->err_fd, STDERR_FILENO) != -1){
+        execv(exec->path, exec->args);
+    }
+    exec->error = errno;
+    _exit(127);
+}
+
+/* Starts the job described by a spawn request of len bytes, and replies to
+ * the server with its pipes and pidfd. The job is cloned sharing the
+ * zygote's memory, as posix_spawn does, so nothing is copied and the
+ * zygote only waits for the exec call itself.
+ */
+static void spawn_job(int sock, char *msg, int len){
+    ZygoteReply reply = {0, 0, 0};
+    char *args[len / 2 + 2];
+    int argc = 0;
+    if(len >= 4){
+        memcpy(&reply.id, msg, 4);
+        for(int i = 4; i < len; i += strlen(msg + i) + 1){
+            args[argc++] = msg + i;
+        }
+    }
+    args[argc] = NULL;
+
+    static char stack[EXEC_STACK_SIZE] __attribute__((aligned(16)));
+    int out[2] = {-1, -1};
+    int err[2] = {-1, -1};
+    int pidfd = -1;
+    if(argc == 0 || msg[len - 1] != '\0'){
+        reply.error = EINVAL;
+    }
+    else if(pipe2(out, O_CLOEXEC) == -1 || pipe2(err, O_CLOEXEC) == -1){
+        reply.error = errno;
+    }
+    else{
+        // CLONE_VFORK suspends the zygote until the job has exec'd or
+        // exited, so the shared memory is only used by one of them at a
+        // time. CLONE_PARENT makes the job a child of the server, not of
+        // the zygote, so the server gets its SIGCHLD and can wait for it.
+        ExecArgs exec = {args[0], args, out[1], err[1], 0};
+        int pid = clone(exec_job, stack + EXEC_STACK_SIZE,
+                        CLONE_VM | CLONE_VFORK | CLONE_PARENT | CLONE_PIDFD | SIGCHLD,
+                        &exec, &pidfd);
+        if(pid == -1){
+            reply.error = errno;
+        }
+        else{
+            reply.pid = pid;
+            reply.error = exec.error;
+        }
+    }
+
+    struct iovec iov = {&reply, sizeof(reply)};
+    struct msghdr header;
+    memset(&header, 0, sizeof(header));
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * ZYGOTE_FDS)];
+        struct cmsghdr align;
+    } control;
+    if(reply.error == 0){
+        int fds[ZYGOTE_FDS];
+        fds[ZYGOTE_STDOUT] = out[0];
+        fds[ZYGOTE_STDERR] = err[0];
+        fds[ZYGOTE_PIDFD] = pidfd;
+        header.msg_control = control.buf;
+        header.msg_controllen = sizeof(control.buf);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&header);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    }
+    if(sendmsg(sock, &header, MSG_NOSIGNAL) == -1){
+        perror("zygote: sendmsg");
+    }
+    // The server has its own copies now
+    close_pipe(out);
+    close_pipe(err);
+    if(pidfd != -1){
+        close(pidfd);
+    }
+}
+
+/* The zygote's loop: serves spawn requests until the server closes its
+ * end of the socket.
+ */
+static void zygote_main(int sock){
+    // The server shuts the zygote down by closing the socket, after it has
+    // handled SIGINT itself
+    signal(SIGINT, SIG_IGN);
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+
+    static char msg[ZYGOTE_MSG_MAX];
+    while(1){
+        ssize_t len = recv(sock, msg, sizeof(msg), 0);
+        if(len == -1 && errno == EINTR){
+            continue;
+        }
+        if(len <= 0){
+            _exit(0);
+        }
+        spawn_job(sock, msg, len);
+    }
+}
+
+/* Forks the zygote, a helper process that starts jobs for the server. It
+ * should be started before the server opens any other file or thread, so
+ * it stays small and holds nothing that could leak into a job. Jobs are
+ * created with CLONE_PARENT, so they are children of the server, which
+ * reaps them as usual.
+ * Returns the server's end of the zygote's socket and sets pid, or returns
+ * -1 on error.
+ */
+int zygote_start(pid_t *pid){
+    int fds[2];
+    // Each request and reply is one datagram, and close-on-exec keeps the
+    // socket out of jobs
+    if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) == -1){
+        perror("socketpair");
+        return -1;
+    }
+    *pid = fork();
+    if(*pid == -1){
+        perror("fork");
+        close_pipe(fds);
+        return -1;
+    }
+    if(*pid == 0){
+        close(fds[0]);
+        zygote_main(fds[1]);
+    }
+    close(fds[1]);
+    return fds[0];
+}
+
+/* Builds a request for the zygote to run the program at path with the
+ * NULL-terminated args, to be sent with zygote_send. The reply comes later
+ * with the same id.
+ * Returns the allocated request and sets len, or returns NULL on error.
+ */
+char *zygote_encode(uint32_t id, const char *path, char * const args[], int *len){
+    // path takes the place of args[0]
+    int total = 4;
+    const char *arg = path;
+    for(int i = 0; arg != NULL; arg = args[++i]){
+        total += strlen(arg) + 1;
+    }
+    if(total > ZYGOTE_MSG_MAX){
+        fprintf(stderr, "zygote: request too long\n");
+        return NULL;
+    }
+    char *msg = malloc(total);
+    if(msg == NULL){
+        perror("malloc zygote request");
+        return NULL;
+    }
+    memcpy(msg, &id, 4);
+    int offset = 4;
+    arg = path;
+    for(int i = 0; arg != NULL; arg = args[++i]){
+        int arg_len = strlen(arg) + 1;
+        memcpy(msg + offset, arg, arg_len);
+        offset += arg_len;
+    }
+    *len = total;
+    return msg;
+}
+
+/* Sends the zygote a request built by zygote_encode, without blocking.
+ * Returns 1 if it was sent, 0 if the socket has no room for it yet, or -1
+ * on error.
+ */
+int zygote_send(int fd, const char *msg, int len){
+    if(send(fd, msg, len, MSG_DONTWAIT | MSG_NOSIGNAL) == -1){
+        if(errno == EAGAIN || errno == EWOULDBLOCK){
+            return 0;
+        }
+        perror("send to zygote");
+        return -1;
+    }
+    return 1;
+}
+
+/* Reads the next reply from the zygote, and the fds that come with it.
+ * Returns 1 if a reply was read, 0 if none is waiting, or -1 if the
+ * zygote has gone away.
+ */
+int zygote_receive(int fd, ZygoteReply *reply, int fds[ZYGOTE_FDS]){
+    struct iovec iov = {reply, sizeof(*reply)};
+    struct msghdr header;
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * ZYGOTE_FDS)];
+        struct cmsghdr align;
+    } control;
+    memset(&header, 0, sizeof(header));
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    header.msg_control = control.buf;
+    header.msg_controllen = sizeof(control.buf);
+    ssize_t len = recvmsg(fd, &header, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    if(len == -1){
+        if(errno == EAGAIN || errno == EWOULDBLOCK){
+            return 0;
+        }
+        perror("recvmsg from zygote");
+        return -1;
+    }
+    if(len == 0){
+        return -1;
+    }
+    for(int i = 0; i < ZYGOTE_FDS; i++){
+        fds[i] = -1;
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&header);
+    if(cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+       cmsg->cmsg_len == CMSG_LEN(sizeof(int) * ZYGOTE_FDS)){
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * ZYGOTE_FDS);
+    }
+    if(len != sizeof(*reply)){
+        reply->error = EPROTO;
+    }
+    else if(reply->error == 0 && fds[0] == -1){
+        reply->error = EPROTO;
+    }
+    return 1;
+}
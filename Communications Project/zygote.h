@@ -0,0 +1,60 @@
+#ifndef _ZYGOTE_H_
+#define _ZYGOTE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "jobprotocol.h"
+
+// Largest spawn request: its id, then the program's path and arguments,
+// each null-terminated, which come from a command of at most BUF_MAX bytes
+#define ZYGOTE_MSG_MAX (4 + BUFSIZE + BUF_MAX)
+
+// File descriptors passed back with a successful reply, in this order
+#define ZYGOTE_STDOUT 0
+#define ZYGOTE_STDERR 1
+#define ZYGOTE_PIDFD 2
+#define ZYGOTE_FDS 3
+
+/* The zygote's answer to a spawn request. On success error is 0 and the
+ * read ends of the job's stdout and stderr pipes and its pidfd come with
+ * it. Otherwise error is an errno value, and pid is the job that failed to
+ * exec, or 0 if none was created.
+ */
+struct zygote_reply {
+        uint32_t id;
+        int pid;
+        int error;
+};
+typedef struct zygote_reply ZygoteReply;
+
+/* Forks the zygote, a helper process that starts jobs for the server. It
+ * should be started before the server opens any other file or thread, so
+ * it stays small and holds nothing that could leak into a job. Jobs are
+ * created with CLONE_PARENT, so they are children of the server, which
+ * reaps them as usual.
+ * Returns the server's end of the zygote's socket and sets pid, or returns
+ * -1 on error.
+ */
+int zygote_start(pid_t *pid);
+
+/* Builds a request for the zygote to run the program at path with the
+ * NULL-terminated args, to be sent with zygote_send. The reply comes later
+ * with the same id.
+ * Returns the allocated request and sets len, or returns NULL on error.
+ */
+char *zygote_encode(uint32_t id, const char *path, char * const args[], int *len);
+
+/* Sends the zygote a request built by zygote_encode, without blocking.
+ * Returns 1 if it was sent, 0 if the socket has no room for it yet, or -1
+ * on error.
+ */
+int zygote_send(int fd, const char *msg, int len);
+
+/* Reads the next reply from the zygote, and the fds that come with it.
+ * Returns 1 if a reply was read, 0 if none is waiting, or -1 if the
+ * zygote has gone away.
+ */
+int zygote_receive(int fd, ZygoteReply *reply, int fds[ZYGOTE_FDS]);
+
+#endif